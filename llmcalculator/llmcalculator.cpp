@@ -3,126 +3,4612 @@
 #include <string>
 #include <sstream>
 #include <map>
+#include <vector>
 #include <cmath>
 #include <algorithm>
 #include <stdexcept>
 #include <iomanip>
+#include <functional>
+#include <array>
+#include <cstdint>
+#include <string_view>
+#include <filesystem>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <deque>
+#include <condition_variable>
+#include <optional>
+#include <cstring>
+#include <cerrno>
+#include <memory>
+#include <regex>
+
+// opt in (-DLLMCALC_IO_URING, link with -luring), the default build reads files with plain blocking reads
+#if defined(LLMCALC_IO_URING) && defined(__linux__)
+#include <liburing.h>
+#define HAVE_IO_URING
+#endif
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include "nlohmann/json.hpp"
-using json = nlohmann::json;
 
 using namespace std;
 
-const map<string, double> gguf_quants{
-    {"IQ1_S", 1.56},
-    {"IQ2_XXS", 2.06},
-    {"IQ2_XS", 2.31},
-    {"IQ2_S", 2.5},
-    {"IQ2_M", 2.7},
-    {"IQ3_XXS", 3.06},
-    {"IQ3_XS", 3.3},
-    {"Q2_K", 3.35},
-    {"Q3_K_S", 3.5},
-    {"IQ3_S", 3.5},
-    {"IQ3_M", 3.7},
-    {"Q3_K_M", 3.91},
-    {"Q3_K_L", 4.27},
-    {"IQ4_XS", 4.25},
-    {"IQ4_NL", 4.5},
-    {"Q4_0", 4.55},
-    {"Q4_K_S", 4.58},
-    {"Q4_K_M", 4.85},
-    {"Q5_0", 5.54},
-    {"Q5_K_S", 5.54},
-    {"Q5_K_M", 5.69},
-    {"Q6_K", 6.59},
-    {"Q8_0", 8.5}
+// bump allocator for json documents, rewound with reset() between requests instead of freeing node by node
+class Arena {
+public:
+    explicit Arena(size_t block_bytes = 64 << 10) : block_size(block_bytes) {}
+
+    void* allocate(size_t n) {
+        n = (n + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+        while (current < blocks.size() && offset + n > blocks[current].size) {
+            current++;
+            offset = 0;
+        }
+        if (current == blocks.size()) {
+            size_t size = max(block_size, n);
+            blocks.push_back({ unique_ptr<char[]>(new char[size]), size });
+            offset = 0;
+        }
+        void* p = blocks[current].data.get() + offset;
+        offset += n;
+        return p;
+    }
+
+    // keeps the blocks for the next request
+    void reset() {
+        current = 0;
+        offset = 0;
+    }
+
+private:
+    struct Block {
+        unique_ptr<char[]> data;
+        size_t size;
+    };
+    vector<Block> blocks;
+    size_t block_size;
+    size_t current = 0;
+    size_t offset = 0;
+};
+
+// the arena json allocates from on this thread, the heap when there is none
+thread_local Arena* active_arena = nullptr;
+
+struct ArenaScope {
+    Arena* previous;
+    explicit ArenaScope(Arena& arena) : previous(active_arena) { active_arena = &arena; }
+    ~ArenaScope() { active_arena = previous; }
+};
+
+// basic_json default constructs its allocators, so the arena is picked up from the thread. every block carries a
+// header saying where it came from, documents built outside a scope (or outliving one) still free correctly
+template <class T>
+struct ArenaAllocator {
+    using value_type = T;
+    static constexpr size_t header = alignof(max_align_t);
+
+    ArenaAllocator() = default;
+    template <class U>
+    ArenaAllocator(const ArenaAllocator<U>&) {}
+
+    T* allocate(size_t n) {
+        size_t bytes = n * sizeof(T) + header;
+        char* p = static_cast<char*>(active_arena ? active_arena->allocate(bytes) : ::operator new(bytes));
+        p[0] = active_arena != nullptr;
+        return reinterpret_cast<T*>(p + header);
+    }
+
+    void deallocate(T* ptr, size_t) {
+        char* p = reinterpret_cast<char*>(ptr) - header;
+        if (!p[0]) ::operator delete(p);
+    }
+
+    template <class U>
+    bool operator==(const ArenaAllocator<U>&) const { return true; }
+    template <class U>
+    bool operator!=(const ArenaAllocator<U>&) const { return false; }
+};
+
+// keys and string values come from the arena too, not just the containers holding them
+using arena_string = basic_string<char, char_traits<char>, ArenaAllocator<char>>;
+
+using json = nlohmann::basic_json<map, vector, arena_string, bool, int64_t, uint64_t, double, ArenaAllocator>;
+
+// ggml tensor types that gguf presets are built from
+enum GgmlType : uint8_t {
+    GGML_F32, GGML_F16, GGML_Q4_0, GGML_Q5_0, GGML_Q5_1, GGML_Q8_0,
+    GGML_Q2_K, GGML_Q3_K, GGML_Q4_K, GGML_Q5_K, GGML_Q6_K,
+    GGML_IQ1_S, GGML_IQ2_XXS, GGML_IQ2_XS, GGML_IQ2_S, GGML_IQ3_XXS, GGML_IQ3_S, GGML_IQ4_NL, GGML_IQ4_XS
+};
+
+constexpr double ggml_type_bits[] = {
+    32, 16, 4.5, 5.5, 6, 8.5,
+    2.625, 3.4375, 4.5, 5.5, 6.5625,
+    1.5625, 2.0625, 2.3125, 2.5625, 3.0625, 3.4375, 4.5, 4.25
+};
+
+constexpr int ggml_block_size[] = {
+    1, 1, 32, 32, 32, 32,
+    256, 256, 256, 256, 256,
+    256, 256, 256, 256, 256, 256, 32, 256
+};
+
+// super block of the k-quants and i-quants
+constexpr int QK_K = 256;
+
+constexpr const char* ggml_type_names[] = {
+    "F32", "F16", "Q4_0", "Q5_0", "Q5_1", "Q8_0",
+    "Q2_K", "Q3_K", "Q4_K", "Q5_K", "Q6_K",
+    "IQ1_S", "IQ2_XXS", "IQ2_XS", "IQ2_S", "IQ3_XXS", "IQ3_S", "IQ4_NL", "IQ4_XS"
+};
+
+// llama-quantize presets (llama_ftype), in gguf_quants order
+enum GgufFtype : uint8_t {
+    FTYPE_IQ1_S, FTYPE_IQ2_XXS, FTYPE_IQ2_XS, FTYPE_IQ2_S, FTYPE_IQ2_M, FTYPE_IQ3_XXS, FTYPE_IQ3_XS,
+    FTYPE_Q2_K, FTYPE_Q3_K_S, FTYPE_IQ3_S, FTYPE_IQ3_M, FTYPE_Q3_K_M, FTYPE_Q3_K_L, FTYPE_IQ4_XS,
+    FTYPE_IQ4_NL, FTYPE_Q4_0, FTYPE_Q4_K_S, FTYPE_Q4_K_M, FTYPE_Q5_0, FTYPE_Q5_K_S, FTYPE_Q5_K_M, FTYPE_Q6_K,
+    FTYPE_Q8_0
+};
+
+struct GgufQuant {
+    string_view name;
+    double bpw;         // whole file average, used when the architecture isn't known
+    GgmlType base_type; // what most tensors end up as
+    GgufFtype ftype;    // what the per tensor rules switch on
+};
+
+constexpr GgufQuant gguf_quants[] = {
+    {"IQ1_S", 1.56, GGML_IQ1_S, FTYPE_IQ1_S},
+    {"IQ2_XXS", 2.06, GGML_IQ2_XXS, FTYPE_IQ2_XXS},
+    {"IQ2_XS", 2.31, GGML_IQ2_XS, FTYPE_IQ2_XS},
+    {"IQ2_S", 2.5, GGML_IQ2_XS, FTYPE_IQ2_S},
+    {"IQ2_M", 2.7, GGML_IQ2_S, FTYPE_IQ2_M},
+    {"IQ3_XXS", 3.06, GGML_IQ3_XXS, FTYPE_IQ3_XXS},
+    {"IQ3_XS", 3.3, GGML_IQ3_S, FTYPE_IQ3_XS},
+    {"Q2_K", 3.35, GGML_Q2_K, FTYPE_Q2_K},
+    {"Q3_K_S", 3.5, GGML_Q3_K, FTYPE_Q3_K_S},
+    {"IQ3_S", 3.5, GGML_IQ3_S, FTYPE_IQ3_S},
+    {"IQ3_M", 3.7, GGML_IQ3_S, FTYPE_IQ3_M},
+    {"Q3_K_M", 3.91, GGML_Q3_K, FTYPE_Q3_K_M},
+    {"Q3_K_L", 4.27, GGML_Q3_K, FTYPE_Q3_K_L},
+    {"IQ4_XS", 4.25, GGML_IQ4_XS, FTYPE_IQ4_XS},
+    {"IQ4_NL", 4.5, GGML_IQ4_NL, FTYPE_IQ4_NL},
+    {"Q4_0", 4.55, GGML_Q4_0, FTYPE_Q4_0},
+    {"Q4_K_S", 4.58, GGML_Q4_K, FTYPE_Q4_K_S},
+    {"Q4_K_M", 4.85, GGML_Q4_K, FTYPE_Q4_K_M},
+    {"Q5_0", 5.54, GGML_Q5_0, FTYPE_Q5_0},
+    {"Q5_K_S", 5.54, GGML_Q5_K, FTYPE_Q5_K_S},
+    {"Q5_K_M", 5.69, GGML_Q5_K, FTYPE_Q5_K_M},
+    {"Q6_K", 6.59, GGML_Q6_K, FTYPE_Q6_K},
+    {"Q8_0", 8.5, GGML_Q8_0, FTYPE_Q8_0}
+};
+
+constexpr size_t GGUF_QUANT_COUNT = sizeof(gguf_quants) / sizeof(gguf_quants[0]);
+constexpr size_t GGUF_QUANT_SLOTS = 64; // power of two, roomy enough for a seed to show up quickly
+
+constexpr char asciiLower(char c) {
+    return (c >= 'A' && c <= 'Z') ? (char)(c - 'A' + 'a') : c;
+}
+
+// seeded fnv-1a over the lowercased name, so "q4_k_m" and "Q4_K_M" land in the same slot
+constexpr uint32_t quantHash(string_view name, uint32_t seed) {
+    uint32_t h = 2166136261u ^ seed;
+    for (char c : name) {
+        h ^= (uint8_t)asciiLower(c);
+        h *= 16777619u;
+    }
+    return h ^ (h >> 15);
+}
+
+constexpr bool iequals(string_view a, string_view b) {
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); i++) {
+        if (asciiLower(a[i]) != asciiLower(b[i])) return false;
+    }
+    return true;
+}
+
+// smallest seed that sends every quant name to its own slot
+constexpr uint32_t findQuantSeed() {
+    for (uint32_t seed = 0; seed < 100000; seed++) {
+        bool used[GGUF_QUANT_SLOTS]{};
+        bool ok = true;
+        for (size_t i = 0; i < GGUF_QUANT_COUNT && ok; i++) {
+            size_t slot = quantHash(gguf_quants[i].name, seed) & (GGUF_QUANT_SLOTS - 1);
+            ok = !used[slot];
+            used[slot] = true;
+        }
+        if (ok) return seed;
+    }
+    return UINT32_MAX;
+}
+
+constexpr uint32_t gguf_quant_seed = findQuantSeed();
+static_assert(gguf_quant_seed != UINT32_MAX, "no perfect hash seed for gguf_quants, bump GGUF_QUANT_SLOTS");
+
+constexpr array<int8_t, GGUF_QUANT_SLOTS> buildQuantSlots() {
+    array<int8_t, GGUF_QUANT_SLOTS> slots{};
+    for (auto& s : slots) s = -1;
+    for (size_t i = 0; i < GGUF_QUANT_COUNT; i++) {
+        slots[quantHash(gguf_quants[i].name, gguf_quant_seed) & (GGUF_QUANT_SLOTS - 1)] = (int8_t)i;
+    }
+    return slots;
+}
+
+constexpr array<int8_t, GGUF_QUANT_SLOTS> gguf_quant_slots = buildQuantSlots();
+
+// case insensitive, nullptr when the name isn't a known preset
+constexpr const GgufQuant* findGgufQuant(string_view name) {
+    int8_t idx = gguf_quant_slots[quantHash(name, gguf_quant_seed) & (GGUF_QUANT_SLOTS - 1)];
+    if (idx < 0 || !iequals(gguf_quants[idx].name, name)) return nullptr;
+    return &gguf_quants[idx];
+}
+
+static_assert(findGgufQuant("q4_k_m") == &gguf_quants[17], "gguf quant lookup is broken");
+
+// how a quantization format lays out its weights and what the engine running it needs on top.
+// the builtins below can be extended or overridden with --formats (see loadQuantFormats)
+struct QuantFormat {
+    string engine{};                  // what usually runs it, only used for display
+    double bits{};                    // default bits per quantized weight
+    bool gguf_table{};                // bpw comes from gguf_quants instead of bits
+    bool native_dtype{};              // checkpoint as published, sized from torch_dtype/quantization_config
+    bool bpw_includes_overhead{};     // user given bpw is already a file average (exl2 style)
+    int group_size{};                 // weights sharing one scale/zero point, 0 = per tensor
+    double scale_bits{};              // per group
+    double zero_bits{};               // per group
+    bool quantize_embeddings{ true }; // token embeddings stored at the quantized width
+    bool quantize_lm_head{ true };    // output projection stored at the quantized width
+    double fixed_overhead_mib{};      // kernel workspace/scratch allocated once per process
+    double overhead_ratio{};          // extra buffers that scale with the weights (dequant scratch etc)
+};
+
+// weights-only formats run by the usual serving engines: per group scale (and zero point), embeddings and
+// the lm head left at 16 bits
+QuantFormat groupQuant(string engine, double bits, int group_size, double scale_bits, double zero_bits) {
+    QuantFormat qf;
+    qf.engine = move(engine);
+    qf.bits = bits;
+    qf.group_size = group_size;
+    qf.scale_bits = scale_bits;
+    qf.zero_bits = zero_bits;
+    qf.quantize_embeddings = false;
+    qf.quantize_lm_head = false;
+    return qf;
+}
+
+map<string, QuantFormat> quant_formats = [] {
+    map<string, QuantFormat> m;
+
+    // llama.cpp, the context buffers are modelled directly by ctxSize
+    QuantFormat gguf;
+    gguf.engine = "llama.cpp";
+    gguf.gguf_table = true;
+    gguf.bpw_includes_overhead = true;
+    m["gguf"] = gguf;
+
+    QuantFormat native;
+    native.engine = "transformers/vllm/tgi";
+    native.native_dtype = true;
+    m["native"] = native;
+
+    QuantFormat exl2;
+    exl2.engine = "exllamav2";
+    exl2.bits = 4.5;
+    exl2.bpw_includes_overhead = true;
+    m["exl2"] = exl2;
+
+    QuantFormat exl3;
+    exl3.engine = "exllamav3";
+    exl3.bits = 4.0;
+    exl3.bpw_includes_overhead = true;
+    exl3.quantize_embeddings = false;
+    m["exl3"] = exl3;
+
+    m["awq"] = groupQuant("vllm/tgi", 4, 128, 16, 4);
+    m["gptq"] = groupQuant("vllm/tgi", 4, 128, 16, 4);
+    // blocksize 64 absmax with double quantization, ~8.127 bits of scale per block
+    m["nf4"] = groupQuant("bitsandbytes", 4, 64, 8.127, 0);
+    m["nf4"].overhead_ratio = 0.01;
+    m["hqq"] = groupQuant("hqq", 4, 64, 16, 16);
+    m["fp8"] = groupQuant("vllm/tgi", 8, 0, 0, 0);
+    // LLM.int8, one f32 scale per output row is too small to show up
+    m["int8"] = groupQuant("bitsandbytes", 8, 0, 0, 0);
+    m["mlx"] = groupQuant("mlx", 4, 64, 16, 16);
+    m["mlx"].quantize_embeddings = true;
+    m["mlx"].quantize_lm_head = true;
+
+    return m;
+}();
+
+// a read only view of a whole file, mapped where the os allows it and read into one buffer otherwise,
+// so the json parser always gets a contiguous range instead of pulling characters through a stream
+class MappedFile {
+public:
+    explicit MappedFile(const string& path) {
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        LARGE_INTEGER length{};
+        if (file != INVALID_HANDLE_VALUE && GetFileSizeEx(file, &length) && length.QuadPart > 0) {
+            mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (mapping != nullptr) {
+                ptr = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+                size = (size_t)length.QuadPart;
+            }
+        }
+#else
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st {};
+        if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                ptr = static_cast<const char*>(p);
+                size = st.st_size;
+                mapped = true;
+            }
+        }
+        if (fd >= 0) close(fd);
+#endif
+        if (ptr != nullptr) return;
+
+        // empty files, pipes and filesystems that can't map
+        ifstream in(path, ios::binary);
+        if (!in.is_open()) {
+            throw runtime_error("Failed to open file: " + path);
+        }
+        buffer.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+        ptr = buffer.data();
+        size = buffer.size();
+    }
+
+    ~MappedFile() {
+#ifdef _WIN32
+        if (mapping != nullptr) {
+            if (buffer.empty() && ptr != nullptr) UnmapViewOfFile(ptr);
+            CloseHandle(mapping);
+        }
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+        if (mapped) munmap(const_cast<char*>(ptr), size);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* begin() const { return ptr; }
+    const char* end() const { return ptr + size; }
+
+private:
+    const char* ptr{};
+    size_t size{};
+    string buffer;
+#ifdef _WIN32
+    HANDLE file{ INVALID_HANDLE_VALUE };
+    HANDLE mapping{};
+#else
+    bool mapped{};
+#endif
+};
+
+// what names the file in the error, e.g. "inventory"
+json readJsonFile(const string& path, const string& what) {
+    unique_ptr<MappedFile> file;
+    try {
+        file = make_unique<MappedFile>(path);
+    }
+    catch (exception&) {
+        throw runtime_error("Failed to open " + what + ": " + path);
+    }
+    return json::parse(file->begin(), file->end());
+}
+
+
+// --formats file layout, every field is optional and falls back to the builtin (or zero):
+// { "name": { "engine": "...", "bits": 4, "group_size": 128, "scale_bits": 16, "zero_bits": 4,
+//             "quantize_embeddings": false, "quantize_lm_head": false,
+//             "fixed_overhead_mib": 0, "overhead_ratio": 0 } }
+void loadQuantFormats(const string& path) {
+    json j = readJsonFile(path, "quant format file");
+    for (auto& item : j.items()) {
+        const json& f = item.value();
+        string key(item.key());
+        transform(key.begin(), key.end(), key.begin(), ::tolower);
+
+        QuantFormat qf = quant_formats.count(key) ? quant_formats.at(key) : QuantFormat{};
+        qf.engine = f.value("engine", qf.engine);
+        qf.bits = f.value("bits", qf.bits);
+        qf.gguf_table = f.value("gguf_table", qf.gguf_table);
+        qf.native_dtype = f.value("native_dtype", qf.native_dtype);
+        qf.bpw_includes_overhead = f.value("bpw_includes_overhead", qf.bpw_includes_overhead);
+        qf.group_size = f.value("group_size", qf.group_size);
+        qf.scale_bits = f.value("scale_bits", qf.scale_bits);
+        qf.zero_bits = f.value("zero_bits", qf.zero_bits);
+        qf.quantize_embeddings = f.value("quantize_embeddings", qf.quantize_embeddings);
+        qf.quantize_lm_head = f.value("quantize_lm_head", qf.quantize_lm_head);
+        qf.fixed_overhead_mib = f.value("fixed_overhead_mib", qf.fixed_overhead_mib);
+        qf.overhead_ratio = f.value("overhead_ratio", qf.overhead_ratio);
+        quant_formats[key] = qf;
+    }
+}
+
+// bits per element of a torch/safetensors dtype name, "torch.bfloat16", "BF16" and "float8_e4m3fn" all work
+double dtypeBits(string dtype) {
+    transform(dtype.begin(), dtype.end(), dtype.begin(), ::tolower);
+    if (dtype.rfind("torch.", 0) == 0) dtype = dtype.substr(6);
+
+    static const map<string, double> dtype_bits{
+        {"float64", 64}, {"double", 64}, {"f64", 64},
+        {"float32", 32}, {"float", 32}, {"fp32", 32}, {"f32", 32},
+        {"float16", 16}, {"half", 16}, {"fp16", 16}, {"f16", 16},
+        {"bfloat16", 16}, {"bf16", 16},
+        {"int8", 8}, {"uint8", 8}, {"i8", 8}, {"u8", 8},
+        {"int4", 4}, {"uint4", 4}
+    };
+    auto it = dtype_bits.find(dtype);
+    if (it != dtype_bits.end()) return it->second;
+
+    // every float8 flavour (e4m3fn, e4m3fnuz, e5m2, ...) is one byte
+    if (dtype.rfind("float8", 0) == 0 || dtype.rfind("fp8", 0) == 0 || dtype.rfind("f8", 0) == 0) return 8;
+
+    throw runtime_error("Unknown torch_dtype: " + dtype);
+}
+
+// vision/audio tower of a multimodal model plus the projector into the text model
+struct EncoderConfig {
+    int hidden_size{};
+    int intermediate_size{};
+    int num_hidden_layers{};
+    int num_attention_heads{};
+    int image_size{};        // native resolution, 0 for audio or dynamic resolution models
+    int patch_size{};
+    int merge_size{ 1 };     // patches merged per side before the projector (qwen2-vl)
+    int num_channels{ 3 };
+    int tokens_per_image{};  // fixed budget when the model pools/resamples to one (gemma3)
+    int projector_out{};     // text hidden size the projector maps into
+
+    bool present() const { return hidden_size > 0 && num_hidden_layers > 0; }
+};
+
+struct ModelConfig {
+    int hidden_size{};
+    int num_attention_heads{};
+    int num_key_value_heads{};
+    int num_hidden_layers{};
+    int vocab_size{};
+    int intermediate_size{};
+    int head_dim{};
+    int num_experts{};
+    int expert_intermediate_size{};
+    bool gated_ffn{ true };
+    bool tie_word_embeddings{};
+    std::string model_type{};
+    std::string torch_dtype{};
+    double parameters{};
+
+    // from quantization_config, quant_method is mapped to a quant_formats key when it's a known one
+    std::string quant_method{};
+    double quant_bits{};
+    int quant_group_size{};
+
+    EncoderConfig vision{};
+    EncoderConfig audio{};
+
+    // bytes per element
+    double get_dtype_divider() const {
+        return dtypeBits(torch_dtype) / 8.0;
+    }
+};
+
+
+// pre-quantized checkpoints describe themselves in quantization_config (mlx calls it quantization)
+void parseQuantizationConfig(const json& qc, ModelConfig& mc) {
+    string method = qc.value("quant_method", string());
+    transform(method.begin(), method.end(), method.begin(), ::tolower);
+
+    if (method == "bitsandbytes") {
+        mc.quant_method = qc.value("load_in_4bit", false) ? "nf4" : "int8";
+        mc.quant_bits = qc.value("load_in_4bit", false) ? 4 : 8;
+        return;
+    }
+    if (method == "compressed-tensors") {
+        // take the first weight scheme, that's what every layer uses in practice
+        if (qc.contains("config_groups")) {
+            for (auto& group : qc["config_groups"]) {
+                if (!group.contains("weights") || group["weights"].is_null()) continue;
+                const json& w = group["weights"];
+                mc.quant_bits = w.value("num_bits", 8);
+                bool is_float = w.value("type", "int") == "float";
+                mc.quant_method = is_float ? "fp8" : "gptq";
+                if (w.contains("group_size") && w["group_size"].is_number()) {
+                    mc.quant_group_size = w["group_size"].get<int>();
+                }
+                break;
+            }
+        }
+        return;
+    }
+    if (method.empty() && qc.contains("bits")) {
+        method = "mlx";
+    }
+    // unknown methods are kept as is, only sizing the checkpoint as published needs to understand them
+    mc.quant_method = method;
+    if (qc.contains("bits") && qc["bits"].is_number()) mc.quant_bits = qc["bits"].get<double>();
+    if (qc.contains("group_size") && qc["group_size"].is_number()) mc.quant_group_size = qc["group_size"].get<int>();
+    // fp8 block scales, one f32 per weight_block_size tile
+    if (qc.contains("weight_block_size") && qc["weight_block_size"].is_array() && qc["weight_block_size"].size() == 2) {
+        mc.quant_group_size = qc["weight_block_size"][0].get<int>() * qc["weight_block_size"][1].get<int>();
+    }
+}
+
+// how a family of configs spells the fields ModelConfig needs. every list is tried in order and
+// the first key present (and not null) wins, fixup handles whatever can't be said with aliases
+struct ArchAdapter {
+    vector<string> hidden_size{ "hidden_size" };
+    vector<string> num_attention_heads{ "num_attention_heads" };
+    vector<string> num_key_value_heads{ "num_key_value_heads" };
+    vector<string> num_hidden_layers{ "num_hidden_layers" };
+    vector<string> intermediate_size{ "intermediate_size" };
+    vector<string> vocab_size{ "vocab_size" };
+    vector<string> head_dim{ "head_dim" };
+    vector<string> num_experts{ "num_local_experts", "num_experts", "n_routed_experts" };
+    vector<string> expert_intermediate_size{ "moe_intermediate_size" };
+    bool gated_ffn = true;        // swiglu style gate/up/down instead of up/down
+    bool tie_default = false;     // tie_word_embeddings when the config doesn't say
+    function<void(const json&, ModelConfig&)> fixup{};
+    vector<string> fixup_keys{};  // what fixup reads, so the sax parse keeps it
+};
+
+int configInt(const json& j, const vector<string>& keys, int fallback = 0) {
+    for (auto& key : keys) {
+        if (j.contains(key.c_str()) && j[key.c_str()].is_number()) {
+            return j[key.c_str()].get<int>();
+        }
+    }
+    return fallback;
+}
+
+ArchAdapter gptAdapter(vector<string> ffn_keys) {
+    ArchAdapter a;
+    a.hidden_size = { "n_embd", "hidden_size" };
+    a.num_attention_heads = { "n_head", "num_attention_heads" };
+    a.num_key_value_heads = {};
+    a.num_hidden_layers = { "n_layer", "num_hidden_layers" };
+    a.intermediate_size = ffn_keys;
+    a.gated_ffn = false;
+    a.fixup = [](const json&, ModelConfig& mc) {
+        // n_inner: null means 4 * n_embd
+        if (mc.intermediate_size == 0) mc.intermediate_size = 4 * mc.hidden_size;
+    };
+    return a;
+}
+
+ArchAdapter plainAdapter(bool gated) {
+    ArchAdapter a;
+    a.gated_ffn = gated;
+    return a;
+}
+
+// keyed on model_type, anything not listed goes through the default (llama style) adapter
+const map<string, ArchAdapter> arch_adapters = [] {
+    map<string, ArchAdapter> m;
+
+    ArchAdapter gpt2 = gptAdapter({ "n_inner" });
+    gpt2.tie_default = true;
+    m["gpt2"] = gpt2;
+    m["gptj"] = gptAdapter({ "n_inner" });
+    m["phi-msft"] = gptAdapter({ "n_inner" });
+
+    ArchAdapter falcon;
+    falcon.hidden_size = { "hidden_size", "n_embed" };
+    falcon.num_attention_heads = { "num_attention_heads", "n_head" };
+    falcon.num_key_value_heads = { "num_kv_heads", "n_head_kv", "num_key_value_heads" };
+    falcon.num_hidden_layers = { "num_hidden_layers", "n_layer" };
+    falcon.intermediate_size = { "ffn_hidden_size" };
+    falcon.gated_ffn = false;
+    falcon.fixup_keys = { "new_decoder_architecture", "multi_query" };
+    falcon.fixup = [](const json& j, ModelConfig& mc) {
+        // old falcon configs only say multi_query, the new decoder uses num_kv_heads
+        bool new_arch = j.value("new_decoder_architecture", false);
+        if (!new_arch && j.value("multi_query", false)) mc.num_key_value_heads = 1;
+        if (mc.intermediate_size == 0) mc.intermediate_size = 4 * mc.hidden_size;
+    };
+    m["falcon"] = falcon;
+    m["RefinedWeb"] = falcon;
+    m["RefinedWebModel"] = falcon;
+
+    ArchAdapter mpt;
+    mpt.hidden_size = { "d_model" };
+    mpt.num_attention_heads = { "n_heads" };
+    mpt.num_key_value_heads = {};
+    mpt.num_hidden_layers = { "n_layers" };
+    mpt.intermediate_size = {};
+    mpt.gated_ffn = false;
+    mpt.tie_default = true;
+    mpt.fixup_keys = { "expansion_ratio", "attn_config", "kv_n_heads" };
+    mpt.fixup = [](const json& j, ModelConfig& mc) {
+        mc.intermediate_size = (int)(j.value("expansion_ratio", 4.0) * mc.hidden_size);
+        if (j.contains("attn_config") && j["attn_config"].is_object()) {
+            mc.num_key_value_heads = configInt(j["attn_config"], { "kv_n_heads" }, mc.num_key_value_heads);
+        }
+    };
+    m["mpt"] = mpt;
+
+    ArchAdapter bloom;
+    bloom.hidden_size = { "hidden_size", "n_embed" };
+    bloom.num_attention_heads = { "n_head", "num_attention_heads" };
+    bloom.num_key_value_heads = {};
+    bloom.num_hidden_layers = { "n_layer", "num_hidden_layers" };
+    bloom.intermediate_size = {};
+    bloom.gated_ffn = false;
+    bloom.tie_default = true;
+    bloom.fixup = [](const json&, ModelConfig& mc) {
+        mc.intermediate_size = 4 * mc.hidden_size;
+    };
+    m["bloom"] = bloom;
+
+    ArchAdapter opt = plainAdapter(false);
+    opt.intermediate_size = { "ffn_dim" };
+    opt.tie_default = true;
+    m["opt"] = opt;
+
+    ArchAdapter distilbert = plainAdapter(false);
+    distilbert.hidden_size = { "dim" };
+    distilbert.num_attention_heads = { "n_heads" };
+    distilbert.num_hidden_layers = { "n_layers" };
+    distilbert.intermediate_size = { "hidden_dim" };
+    distilbert.tie_default = true;
+    m["distilbert"] = distilbert;
+
+    // same key names as llama, but a plain two matrix mlp
+    for (const char* name : { "phi", "gpt_neox", "gpt_bigcode", "starcoder2", "bert", "roberta", "xlm-roberta", "nomic_bert" }) {
+        m[name] = plainAdapter(false);
+    }
+    m["gpt_bigcode"].hidden_size = { "n_embd", "hidden_size" };
+    m["gpt_bigcode"].num_attention_heads = { "n_head", "num_attention_heads" };
+    m["gpt_bigcode"].num_hidden_layers = { "n_layer", "num_hidden_layers" };
+    m["gpt_bigcode"].intermediate_size = { "n_inner" };
+    m["gpt_bigcode"].fixup_keys = { "multi_query" };
+    m["gpt_bigcode"].fixup = [](const json& j, ModelConfig& mc) {
+        if (j.value("multi_query", true)) mc.num_key_value_heads = 1;
+        if (mc.intermediate_size == 0) mc.intermediate_size = 4 * mc.hidden_size;
+    };
+    for (const char* name : { "bert", "roberta", "xlm-roberta", "nomic_bert" }) {
+        m[name].tie_default = true;
+    }
+
+    return m;
+}();
+
+const ArchAdapter& findAdapter(const string& model_type) {
+    static const ArchAdapter default_adapter{};
+    auto it = arch_adapters.find(model_type);
+    return it == arch_adapters.end() ? default_adapter : it->second;
+}
+
+
+// keys parseConfig reads outside the adapters' alias lists: wrappers, encoders and quantization_config
+const vector<string> config_base_keys{
+    "model_type", "tie_word_embeddings", "torch_dtype", "text_config", "vision_config", "audio_config",
+    "mm_tokens_per_image", "image_seq_length", "num_image_tokens",
+    "embed_dim", "d_model", "width", "depth", "encoder_layers", "num_layers", "layers", "num_heads",
+    "encoder_attention_heads", "heads", "encoder_ffn_dim", "mlp_dim", "mlp_ratio", "image_size", "patch_size",
+    "spatial_merge_size", "merge_size", "num_channels", "in_channels", "in_chans", "out_hidden_size", "projection_dim",
+    "quantization_config", "quantization", "quant_method", "load_in_4bit", "bits", "group_size", "weight_block_size",
+    "config_groups"
+};
+
+// every key some adapter can ask for. model_type comes after most of them in transformers' sorted output,
+// so the union is kept rather than the active adapter's list
+const vector<string>& configKeys() {
+    static const vector<string> keys = [] {
+        vector<string> k = config_base_keys;
+        vector<const ArchAdapter*> adapters{ &findAdapter("") };
+        for (auto& a : arch_adapters) adapters.push_back(&a.second);
+        for (auto* a : adapters) {
+            for (auto* list : { &a->hidden_size, &a->num_attention_heads, &a->num_key_value_heads, &a->num_hidden_layers,
+                &a->intermediate_size, &a->vocab_size, &a->head_dim, &a->num_experts, &a->expert_intermediate_size, &a->fixup_keys }) {
+                k.insert(k.end(), list->begin(), list->end());
+            }
+        }
+        sort(k.begin(), k.end());
+        k.erase(unique(k.begin(), k.end()), k.end());
+        return k;
+    }();
+    return keys;
+}
+
+// sax handler that builds a dom of the config keys only: id2label, per layer quantization maps and whatever
+// else a checkpoint carries are skipped without allocating. config_groups is kept whole, its group names are free form
+class ConfigSax : public nlohmann::json_sax<json> {
+public:
+    json result;
+
+    bool null() override { return value(nullptr); }
+    bool boolean(bool b) override { return value(b); }
+    bool number_integer(number_integer_t n) override { return value(n); }
+    bool number_unsigned(number_unsigned_t n) override { return value(n); }
+    bool number_float(number_float_t n, const string_t&) override { return value(n); }
+    // sax_parse also instantiates the ubjson reader, which passes number text as std::string or a literal
+    template <class Text>
+    bool number_float(number_float_t n, const Text&) { return value(n); }
+    bool string(string_t& s) override { return value(s); }
+    bool binary(binary_t&) override { return value(nullptr); }
+
+    bool start_object(size_t) override { return open(json::object()); }
+    bool start_array(size_t) override { return open(json::array()); }
+    bool end_object() override { return close(); }
+    bool end_array() override { return close(); }
+
+    bool key(string_t& k) override {
+        if (skip > 0) return true;
+        const Frame& parent = stack.back();
+        if (!parent.whole && !binary_search(configKeys().begin(), configKeys().end(), string_view(k))) {
+            skip_next = true;
+            return true;
+        }
+        pending_key = k;
+        return true;
+    }
+
+    bool parse_error(size_t, const std::string&, const json::exception& ex) override {
+        throw runtime_error(ex.what());
+    }
+
+private:
+    struct Frame {
+        json* node;
+        bool whole;  // keep every key below
+    };
+    vector<Frame> stack;
+    string_t pending_key;
+    bool skip_next = false;
+    int skip = 0;  // depth inside a skipped subtree
+
+    json* place(json v) {
+        if (stack.empty()) {
+            result = move(v);
+            return &result;
+        }
+        json& parent = *stack.back().node;
+        if (parent.is_array()) {
+            parent.push_back(move(v));
+            return &parent.back();
+        }
+        return &(parent[pending_key] = move(v));
+    }
+
+    template <class T>
+    bool value(T&& v) {
+        if (skip > 0) return true;
+        if (skip_next) {
+            skip_next = false;
+            return true;
+        }
+        place(json(std::forward<T>(v)));
+        return true;
+    }
+
+    bool open(json container) {
+        if (skip > 0 || skip_next) {
+            skip_next = false;
+            skip++;
+            return true;
+        }
+        bool whole = !stack.empty() && (stack.back().whole || pending_key == "config_groups");
+        json* node = place(move(container));
+        stack.push_back({ node, whole });
+        return true;
+    }
+
+    bool close() {
+        if (skip > 0) {
+            skip--;
+            return true;
+        }
+        stack.pop_back();
+        return true;
+    }
+};
+
+json parseConfigJson(const char* begin, const char* end) {
+    ConfigSax sax;
+    json::sax_parse(begin, end, &sax);
+    return move(sax.result);
+}
+
+
+EncoderConfig parseEncoderConfig(const json& j, int text_hidden) {
+    EncoderConfig e;
+    // embed_dim first: qwen2-vl's vision_config also carries hidden_size, but that's the language model's width
+    e.hidden_size = configInt(j, { "embed_dim", "hidden_size", "d_model", "width" });
+    e.num_hidden_layers = configInt(j, { "num_hidden_layers", "depth", "encoder_layers", "num_layers", "layers" });
+    e.num_attention_heads = configInt(j, { "num_attention_heads", "num_heads", "encoder_attention_heads", "heads" }, 1);
+    e.intermediate_size = configInt(j, { "intermediate_size", "encoder_ffn_dim", "mlp_dim" });
+    if (e.intermediate_size == 0) {
+        e.intermediate_size = (int)(j.value("mlp_ratio", 4.0) * e.hidden_size);
+    }
+    e.image_size = configInt(j, { "image_size" });
+    e.patch_size = configInt(j, { "patch_size" }, 14);
+    e.merge_size = configInt(j, { "spatial_merge_size", "merge_size" }, 1);
+    e.num_channels = configInt(j, { "num_channels", "in_channels", "in_chans" }, 3);
+    e.projector_out = configInt(j, { "out_hidden_size", "projection_dim" }, text_hidden);
+    return e;
+}
+
+
+ModelConfig parseTextConfig(const json& j, double p) {
+    ModelConfig mc;
+
+    mc.model_type = j.value("model_type", "");
+    const ArchAdapter& a = findAdapter(mc.model_type);
+
+    mc.hidden_size = configInt(j, a.hidden_size);
+    mc.num_attention_heads = configInt(j, a.num_attention_heads);
+    mc.num_hidden_layers = configInt(j, a.num_hidden_layers);
+    if (mc.hidden_size == 0 || mc.num_attention_heads == 0 || mc.num_hidden_layers == 0) {
+        throw runtime_error("Some required keys are missing in the config.json (model_type \"" + mc.model_type + "\")");
+    }
+
+    // no kv head count means plain multi head attention
+    mc.num_key_value_heads = configInt(j, a.num_key_value_heads, mc.num_attention_heads);
+    // not every config carries it, 0 just means the output buffers are left out
+    mc.vocab_size = configInt(j, a.vocab_size);
+    mc.tie_word_embeddings = j.contains("tie_word_embeddings") && j["tie_word_embeddings"].is_boolean()
+        ? j["tie_word_embeddings"].get<bool>() : a.tie_default;
+    // checkpoints without a torch_dtype were saved by transformers' fp32 default
+    mc.torch_dtype = j.contains("torch_dtype") && j["torch_dtype"].is_string() ? j["torch_dtype"].get<string>() : "float32";
+    // only needed for per tensor sizing, which falls back to a flat bpw without them
+    mc.intermediate_size = configInt(j, a.intermediate_size);
+    mc.head_dim = configInt(j, a.head_dim, mc.hidden_size / mc.num_attention_heads);
+    mc.num_experts = configInt(j, a.num_experts);
+    mc.expert_intermediate_size = configInt(j, a.expert_intermediate_size, mc.intermediate_size);
+    mc.gated_ffn = a.gated_ffn;
+    mc.parameters = p;
+
+    if (a.fixup) {
+        a.fixup(j, mc);
+    }
+
+    if (j.contains("quantization_config")) {
+        parseQuantizationConfig(j["quantization_config"], mc);
+    }
+    else if (j.contains("quantization") && j["quantization"].is_object()) {
+        parseQuantizationConfig(j["quantization"], mc);
+    }
+
+    return mc;
+}
+
+
+ModelConfig parseConfig(const json& j, double p) {
+    ModelConfig mc;
+
+    if (j.contains("text_config")) {
+        // multimodal wrapper, the language model lives in text_config
+        mc = parseTextConfig(j["text_config"], p);
+        // some wrappers only give the dtype/quantization at the top level
+        if (!j["text_config"].contains("torch_dtype") && j.contains("torch_dtype") && j["torch_dtype"].is_string()) {
+            mc.torch_dtype = j["torch_dtype"].get<string>();
+        }
+        if (mc.quant_method.empty() && j.contains("quantization_config")) {
+            parseQuantizationConfig(j["quantization_config"], mc);
+        }
+    }
+    else {
+        mc = parseTextConfig(j, p);
+    }
+
+    if (j.contains("vision_config") && j["vision_config"].is_object()) {
+        mc.vision = parseEncoderConfig(j["vision_config"], mc.hidden_size);
+        mc.vision.tokens_per_image = configInt(j, { "mm_tokens_per_image", "image_seq_length", "num_image_tokens" });
+    }
+    if (j.contains("audio_config") && j["audio_config"].is_object()) {
+        mc.audio = parseEncoderConfig(j["audio_config"], mc.hidden_size);
+    }
+
+    return mc;
+}
+
+
+double inBuffer(int context, const ModelConfig& mc, int bsz) {
+    double inp_tokens = bsz;
+    double inp_embd = (double)mc.hidden_size * bsz;
+    double inp_pos = bsz;
+    double inp_KQ_mask = (double)context * bsz;
+    double inp_K_shift = context;
+    double inp_sum = bsz;
+
+    return inp_tokens + inp_embd + inp_pos + inp_KQ_mask + inp_K_shift + inp_sum;
+}
+
+
+double outBuffer(const ModelConfig& mc, int bsz, bool all_logits) {
+    // llama.cpp keeps a host-side f32 output buffer of n_vocab * n_outputs. normally only the
+    // last token of the sequence is an output, but perplexity/embedding runs ask for every token
+    double n_outputs = all_logits ? bsz : 1;
+    double output_buf = (double)mc.vocab_size * n_outputs * 4;
+    if (all_logits) {
+        // embeddings are copied out alongside the logits
+        output_buf += (double)mc.hidden_size * n_outputs * 4;
+    }
+
+    // the graph is reserved for the worst case where every token in the batch is an output,
+    // so the result_output tensor is always n_vocab * bsz f32 in the compute buffer
+    double logits_buf = (double)mc.vocab_size * bsz * 4;
+
+    return output_buf + logits_buf;
+}
+
+
+// llama.cpp's compute buffer for a given -ub. the context term is the f32 KQ scores of one ubatch
+// (n_head * n_ctx * n_ubatch * 4), which flash attention never materializes; the rest scales with
+// the ubatch. at -ub 512 without flash attention this is the original (ctx / 1024 * 2 + 0.75) MiB per head
+double ubatchComputeBuffer(int context, const ModelConfig& mc, int ubatch, bool flash_attn) {
+    double kq = flash_attn ? 0 : (double)mc.num_attention_heads * context * ubatch * 4;
+    return kq + 0.75 * mc.num_attention_heads * 1024 * 1024 * (ubatch / 512.0);
+}
+
+
+double computeBuffer(int context, const ModelConfig& mc, int bsz) {
+    if (bsz != 512) {
+        cerr << "Warning: batch size other than 512 is currently not supported for the compute buffer calculation" << endl;
+        bsz = 512; // forcibly set
+    }
+    return ubatchComputeBuffer(context, mc, bsz, false);
+}
+
+
+
+double kvCache(int context, const ModelConfig& mc, double cache_bit) {
+    double n_embd_gqa = (double)mc.num_key_value_heads * mc.head_dim;
+    double n_elements = n_embd_gqa * (mc.num_hidden_layers * context);
+    double size = 2.0 * n_elements;
+    return size * (cache_bit / 8.0);
+}
+
+
+double ctxSize(int context, const ModelConfig& mc, int bsz, int cache_bit, bool all_logits = false) {
+    return inBuffer(context, mc, bsz) + kvCache(context, mc, cache_bit) + computeBuffer(context, mc, bsz)
+        + outBuffer(mc, bsz, all_logits);
+}
+
+
+double modelSize(const ModelConfig& mc, double bpw) {
+    return (mc.parameters * bpw) / 8.0;
+}
+
+
+// the format a pre-quantized checkpoint is stored in, with its own group size
+QuantFormat checkpointFormat(const ModelConfig& mc) {
+    auto it = quant_formats.find(mc.quant_method);
+    if (it == quant_formats.end()) {
+        throw runtime_error("Unsupported quantization_config quant_method: " + mc.quant_method);
+    }
+    QuantFormat packed = it->second;
+    if (mc.quant_group_size > 0) packed.group_size = mc.quant_group_size;
+    if (mc.quant_method == "fp8" && mc.quant_group_size > 0) packed.scale_bits = 32;
+    return packed;
+}
+
+
+double modelSize(const ModelConfig& mc, const QuantFormat& qf, double bpw) {
+    if (qf.bpw_includes_overhead) {
+        return modelSize(mc, bpw);
+    }
+
+    if (qf.native_dtype) {
+        // an explicit bpw still wins, otherwise go with what the checkpoint says it is
+        if (bpw > 0) {
+            return modelSize(mc, bpw);
+        }
+        if (!mc.quant_method.empty()) {
+            QuantFormat packed = checkpointFormat(mc);
+            return modelSize(mc, packed, mc.quant_bits > 0 ? mc.quant_bits : packed.bits);
+        }
+        return mc.parameters * mc.get_dtype_divider();
+    }
+
+    double eff_bpw = bpw;
+    if (qf.group_size > 0) {
+        eff_bpw += (qf.scale_bits + qf.zero_bits) / qf.group_size;
+    }
+
+    // embeddings and lm_head are left at the checkpoint dtype by most formats
+    double embd_params = (double)mc.vocab_size * mc.hidden_size;
+    double unquantized = 0;
+    if (!qf.quantize_embeddings) unquantized += embd_params;
+    if (!qf.quantize_lm_head && !mc.tie_word_embeddings) unquantized += embd_params;
+    unquantized = min(unquantized, mc.parameters);
+
+    return (mc.parameters - unquantized) * eff_bpw / 8.0 + unquantized * mc.get_dtype_divider();
+}
+
+
+enum TensorKind {
+    TENSOR_TOKEN_EMBD, TENSOR_OUTPUT, TENSOR_NORM, TENSOR_ATTN_Q, TENSOR_ATTN_K, TENSOR_ATTN_V, TENSOR_ATTN_OUTPUT,
+    TENSOR_FFN_GATE_INP, TENSOR_FFN_GATE, TENSOR_FFN_UP, TENSOR_FFN_DOWN
+};
+
+constexpr const char* tensor_kind_names[] = {
+    "token_embd", "output", "norm", "attn_q", "attn_k", "attn_v", "attn_output",
+    "ffn_gate_inp", "ffn_gate", "ffn_up", "ffn_down"
+};
+
+// one weight matrix of the model, ne0 is the input (row length) like in ggml
+struct TensorSpec {
+    TensorKind kind;
+    int layer;     // -1 for the non repeating tensors
+    double ne0;
+    double ne1;
+    int count;     // experts stacked into the same tensor
+};
+
+
+// llama style decoder layout, empty when the config doesn't carry enough to build it
+vector<TensorSpec> tensorList(const ModelConfig& mc) {
+    vector<TensorSpec> tensors;
+    if (mc.vocab_size <= 0 || mc.intermediate_size <= 0 || mc.head_dim <= 0) {
+        return tensors;
+    }
+
+    double q_dim = (double)mc.num_attention_heads * mc.head_dim;
+    double kv_dim = (double)mc.num_key_value_heads * mc.head_dim;
+
+    tensors.push_back({ TENSOR_TOKEN_EMBD, -1, (double)mc.hidden_size, (double)mc.vocab_size, 1 });
+    for (int i = 0; i < mc.num_hidden_layers; i++) {
+        tensors.push_back({ TENSOR_NORM, i, (double)mc.hidden_size, 1, 2 });
+        tensors.push_back({ TENSOR_ATTN_Q, i, (double)mc.hidden_size, q_dim, 1 });
+        tensors.push_back({ TENSOR_ATTN_K, i, (double)mc.hidden_size, kv_dim, 1 });
+        tensors.push_back({ TENSOR_ATTN_V, i, (double)mc.hidden_size, kv_dim, 1 });
+        tensors.push_back({ TENSOR_ATTN_OUTPUT, i, q_dim, (double)mc.hidden_size, 1 });
+        if (mc.num_experts > 0) {
+            tensors.push_back({ TENSOR_FFN_GATE_INP, i, (double)mc.hidden_size, (double)mc.num_experts, 1 });
+            tensors.push_back({ TENSOR_FFN_GATE, i, (double)mc.hidden_size, (double)mc.expert_intermediate_size, mc.num_experts });
+            tensors.push_back({ TENSOR_FFN_UP, i, (double)mc.hidden_size, (double)mc.expert_intermediate_size, mc.num_experts });
+            tensors.push_back({ TENSOR_FFN_DOWN, i, (double)mc.expert_intermediate_size, (double)mc.hidden_size, mc.num_experts });
+        }
+        else {
+            if (mc.gated_ffn) {
+                tensors.push_back({ TENSOR_FFN_GATE, i, (double)mc.hidden_size, (double)mc.intermediate_size, 1 });
+            }
+            tensors.push_back({ TENSOR_FFN_UP, i, (double)mc.hidden_size, (double)mc.intermediate_size, 1 });
+            tensors.push_back({ TENSOR_FFN_DOWN, i, (double)mc.intermediate_size, (double)mc.hidden_size, 1 });
+        }
+    }
+    tensors.push_back({ TENSOR_NORM, -1, (double)mc.hidden_size, 1, 1 });
+    if (!mc.tie_word_embeddings) {
+        tensors.push_back({ TENSOR_OUTPUT, -1, (double)mc.hidden_size, (double)mc.vocab_size, 1 });
+    }
+
+    return tensors;
+}
+
+
+double tensorParams(const vector<TensorSpec>& tensors) {
+    double total = 0;
+    for (auto& t : tensors) {
+        total += t.ne0 * t.ne1 * t.count;
+    }
+    return total;
+}
+
+
+// llama-quantize's per tensor type selection (llama_tensor_get_type), without the imatrix
+// and user override branches. attn_v and ffn_down show up once per layer so the layer
+// index doubles as llama.cpp's i_attention_wv / i_ffn_down counters
+GgmlType ggufTensorType(const GgufQuant& q, const TensorSpec& t, const ModelConfig& mc) {
+    if (t.kind == TENSOR_NORM || t.kind == TENSOR_FFN_GATE_INP) {
+        return GGML_F32;
+    }
+
+    GgufFtype ft = q.ftype;
+    GgmlType type = q.base_type;
+    int n_layer = mc.num_hidden_layers;
+    int i = t.layer;
+    int n_gqa = mc.num_attention_heads / max(mc.num_key_value_heads, 1);
+    int n_expert = mc.num_experts;
+    // the early falcon checkpoints say RefinedWeb/RefinedWebModel, llama.cpp converts them to the same arch
+    bool falcon = mc.model_type == "falcon" || mc.model_type == "RefinedWeb" || mc.model_type == "RefinedWebModel";
+    auto use_more_bits = [&]() {
+        return i < n_layer / 8 || i >= 7 * n_layer / 8 || (i - n_layer / 8) % 3 == 2;
+    };
+    bool low_iq = ft == FTYPE_IQ2_XXS || ft == FTYPE_IQ2_XS || ft == FTYPE_IQ1_S || ft == FTYPE_IQ2_S || ft == FTYPE_IQ2_M;
+
+    if (t.kind == TENSOR_OUTPUT || (t.kind == TENSOR_TOKEN_EMBD && mc.tie_word_embeddings)) {
+        // llama-quantize checks the k-quant super block here whatever the preset's own block size is
+        if (falcon || (int64_t)t.ne0 % QK_K != 0) type = GGML_Q8_0;
+        else if (low_iq || ft == FTYPE_IQ3_XXS) type = GGML_Q5_K;
+        else if (type != GGML_Q8_0) type = GGML_Q6_K;
+    }
+    else if (t.kind == TENSOR_TOKEN_EMBD) {
+        if (ft == FTYPE_IQ2_XXS || ft == FTYPE_IQ2_XS || ft == FTYPE_IQ1_S) type = GGML_Q2_K;
+        else if (ft == FTYPE_IQ2_S || ft == FTYPE_IQ2_M || ft == FTYPE_IQ3_XXS) type = GGML_IQ3_S;
+    }
+    else if (low_iq) {
+        bool wide = ft == FTYPE_IQ2_S || ft == FTYPE_IQ2_M;
+        if (t.kind == TENSOR_ATTN_V) {
+            if (n_gqa >= 4 || n_expert >= 4) type = GGML_Q4_K;
+            else type = wide ? GGML_IQ3_S : GGML_Q2_K;
+        }
+        else if (t.kind == TENSOR_ATTN_K && n_expert == 8) {
+            type = GGML_Q4_K;
+        }
+        else if (t.kind == TENSOR_FFN_DOWN) {
+            if (i < n_layer / 8) type = wide ? GGML_IQ3_S : GGML_Q2_K;
+        }
+        else if (t.kind == TENSOR_ATTN_OUTPUT) {
+            if (n_expert == 8) type = GGML_Q5_K;
+            else if (ft == FTYPE_IQ1_S) type = GGML_IQ2_XXS;
+            else if (wide) type = GGML_IQ3_S;
+        }
+    }
+    else if (t.kind == TENSOR_ATTN_V) {
+        if (ft == FTYPE_Q2_K) type = n_gqa >= 4 ? GGML_Q4_K : GGML_Q3_K;
+        else if (ft == FTYPE_IQ3_XXS) type = n_gqa >= 4 ? GGML_Q4_K : GGML_IQ3_S;
+        else if ((ft == FTYPE_IQ3_XS || ft == FTYPE_IQ3_S) && n_gqa >= 4) type = GGML_Q4_K;
+        else if (ft == FTYPE_IQ3_M) type = GGML_Q4_K;
+        else if (ft == FTYPE_Q3_K_M) type = i < 2 ? GGML_Q5_K : GGML_Q4_K;
+        else if (ft == FTYPE_Q3_K_L) type = GGML_Q5_K;
+        else if ((ft == FTYPE_IQ4_NL || ft == FTYPE_IQ4_XS) && n_gqa >= 4) type = GGML_Q5_K;
+        else if ((ft == FTYPE_Q4_K_M || ft == FTYPE_Q5_K_M) && use_more_bits()) type = GGML_Q6_K;
+        else if (ft == FTYPE_Q4_K_S && i < 4) type = GGML_Q5_K;
+        // llama 70b shares each attn_v across 8 heads, so the bump is nearly free
+        if (n_layer == 80 && mc.model_type == "llama" && (type == GGML_Q3_K || type == GGML_Q4_K)) type = GGML_Q5_K;
+        if (n_expert == 8) type = GGML_Q8_0;
+    }
+    else if (t.kind == TENSOR_ATTN_K) {
+        if (n_expert == 8) type = GGML_Q8_0;
+        else if (ft == FTYPE_IQ3_XS) type = GGML_IQ3_XXS;
+        // IQ3_XXS drops attn_k/attn_q to IQ2_S only with an imatrix
+    }
+    else if (t.kind == TENSOR_ATTN_Q) {
+        if (ft == FTYPE_IQ3_XS) type = GGML_IQ3_XXS;
+    }
+    else if (t.kind == TENSOR_FFN_DOWN) {
+        if (ft == FTYPE_Q2_K) type = GGML_Q3_K;
+        else if (ft == FTYPE_IQ3_XXS) type = i < n_layer / 8 ? GGML_Q4_K : GGML_Q3_K;
+        else if (ft == FTYPE_Q3_K_M) type = i < n_layer / 16 ? GGML_Q5_K : (!falcon || use_more_bits()) ? GGML_Q4_K : GGML_Q3_K;
+        else if (ft == FTYPE_IQ3_M && (i < n_layer / 8 || (n_expert == 8 && use_more_bits()))) type = GGML_Q4_K;
+        else if (ft == FTYPE_Q3_K_L) type = falcon ? GGML_Q4_K : GGML_Q5_K;
+        else if (ft == FTYPE_Q4_K_M) {
+            if (falcon) type = i < n_layer / 16 ? GGML_Q6_K : use_more_bits() ? GGML_Q5_K : GGML_Q4_K;
+            else if (use_more_bits()) type = GGML_Q6_K;
+        }
+        else if (i < n_layer / 8 && (ft == FTYPE_IQ4_NL || ft == FTYPE_IQ4_XS)) type = GGML_Q5_K;
+        else if (ft == FTYPE_Q5_K_M && use_more_bits()) type = GGML_Q6_K;
+        else if (ft == FTYPE_Q4_K_S && !falcon && i < n_layer / 8) type = GGML_Q5_K;
+    }
+    else if (t.kind == TENSOR_ATTN_OUTPUT) {
+        if (falcon) {
+            if (ft == FTYPE_Q3_K_L) type = GGML_Q4_K;
+        }
+        else if (n_expert == 8) {
+            if (ft == FTYPE_Q2_K || ft == FTYPE_IQ3_XS || ft == FTYPE_IQ3_XXS || ft == FTYPE_Q3_K_S || ft == FTYPE_Q3_K_M || ft == FTYPE_IQ4_NL
+                || ft == FTYPE_Q4_K_S || ft == FTYPE_Q4_K_M || ft == FTYPE_IQ3_S || ft == FTYPE_IQ3_M || ft == FTYPE_IQ4_XS) type = GGML_Q5_K;
+        }
+        else {
+            if (ft == FTYPE_Q2_K) type = GGML_Q3_K;
+            else if (ft == FTYPE_IQ3_XXS) type = GGML_IQ3_S;
+            else if (ft == FTYPE_Q3_K_M) type = GGML_Q4_K;
+            else if (ft == FTYPE_Q3_K_L) type = GGML_Q5_K;
+            else if (ft == FTYPE_IQ3_M) type = GGML_Q4_K;
+        }
+    }
+    else if (t.kind == TENSOR_FFN_GATE || t.kind == TENSOR_FFN_UP) {
+        if (ft == FTYPE_IQ3_XS && i >= n_layer / 8 && i < 7 * n_layer / 8) type = GGML_IQ3_XXS;
+    }
+
+    // rows that don't split into whole blocks fall back to a legacy quant
+    if ((int64_t)t.ne0 % ggml_block_size[type] != 0) {
+        switch (type) {
+        case GGML_Q4_K: type = GGML_Q5_0; break;
+        case GGML_Q5_K: type = GGML_Q5_1; break;
+        case GGML_Q6_K: type = GGML_Q8_0; break;
+        default: type = GGML_IQ4_NL; break;
+        }
+        if ((int64_t)t.ne0 % ggml_block_size[type] != 0) type = GGML_F16;
+    }
+
+    return type;
+}
+
+
+// exact file size for a gguf preset from the architecture, flat bpw if the layout is unknown
+double ggufModelSize(const ModelConfig& mc, const GgufQuant& q) {
+    vector<TensorSpec> tensors = tensorList(mc);
+    if (tensors.empty()) {
+        return modelSize(mc, q.bpw);
+    }
+
+    double total = 0;
+    for (auto& t : tensors) {
+        total += t.ne0 * t.ne1 * t.count * ggml_type_bits[ggufTensorType(q, t, mc)] / 8.0;
+    }
+    return total;
+}
+
+
+void printGgufTensors(const ModelConfig& mc, const GgufQuant& q) {
+    // (kind, type) -> (tensor count, bytes)
+    map<pair<int, int>, pair<int, double>> groups;
+    for (auto& t : tensorList(mc)) {
+        GgmlType type = ggufTensorType(q, t, mc);
+        auto& g = groups[{ t.kind, type }];
+        g.first += t.count;
+        g.second += t.ne0 * t.ne1 * t.count * ggml_type_bits[type] / 8.0;
+    }
+
+    cout << "\nTensors (" << q.name << "):" << endl;
+    for (auto& g : groups) {
+        cout << "  " << left << setw(14) << tensor_kind_names[g.first.first] << setw(8) << ggml_type_names[g.first.second]
+            << right << setw(6) << g.second.first << " x  " << g.second.second / (1024 * 1024) << " MB" << endl;
+    }
+}
+
+
+// encoder blocks + patch/position embeddings + a llava style two layer projector
+double encoderParams(const EncoderConfig& e) {
+    if (!e.present()) return 0;
+
+    double h = e.hidden_size;
+    double layer = 4 * h * h + 2 * h * e.intermediate_size;
+    double patch_embd = (double)e.num_channels * e.patch_size * e.patch_size * h;
+    double grid = e.image_size > 0 ? (double)e.image_size / e.patch_size : 0;
+    double pos_embd = grid * grid * h;
+    double proj_in = h * e.merge_size * e.merge_size;
+    double projector = proj_in * e.projector_out + (double)e.projector_out * e.projector_out;
+
+    return layer * e.num_hidden_layers + patch_embd + pos_embd + projector;
+}
+
+
+// context tokens one image turns into at the given resolution
+int imageTokens(const EncoderConfig& v, int resolution) {
+    if (v.tokens_per_image > 0) return v.tokens_per_image;
+    int grid = resolution / max(v.patch_size, 1);
+    return grid * grid / (v.merge_size * v.merge_size);
+}
+
+
+// the encoder runs one layer at a time over every patch. llama.cpp's clip encodes the images one after another
+// and materializes the attention scores, so its peak is one image's; the python engines batch every image but run
+// sdpa/flash attention, which never keeps the scores. either way each image's projected embeddings stay around
+// until the prompt is decoded
+double visionActivations(const EncoderConfig& v, int resolution, int n_images, bool clip) {
+    if (!v.present()) return 0;
+
+    n_images = max(n_images, 1);
+    double patches = pow((double)(resolution / max(v.patch_size, 1)), 2);
+    double scores = clip ? (double)v.num_attention_heads * patches * patches : 0;
+    double hidden = patches * (6.0 * v.hidden_size + 2.0 * v.intermediate_size);
+    double pass = (scores + hidden) * (clip ? 1 : n_images);
+    double embeddings = (double)n_images * imageTokens(v, resolution) * v.projector_out;
+    return (pass + embeddings) * 4;
+}
+
+
+// mmproj weights (vision + audio towers) and the vision encoder's compute buffer, clip = llama.cpp runs the encoder
+double multimodalSize(const ModelConfig& mc, double bytes_per_weight, int resolution, int n_images, bool clip) {
+    double weights = (encoderParams(mc.vision) + encoderParams(mc.audio)) * bytes_per_weight;
+    return weights + visionActivations(mc.vision, resolution, n_images, clip);
+}
+
+
+// storage width of one tensor in the given format, the per tensor counterpart of modelSize
+double tensorBits(const ModelConfig& mc, const QuantFormat& qf, double bpw, const GgufQuant* gq, const TensorSpec& t) {
+    if (gq) return ggml_type_bits[ggufTensorType(*gq, t, mc)];
+    if (t.kind == TENSOR_NORM || t.kind == TENSOR_FFN_GATE_INP) return dtypeBits(mc.torch_dtype);
+    if (qf.bpw_includes_overhead) return bpw;
+
+    if (qf.native_dtype) {
+        if (bpw > 0) return bpw;
+        if (mc.quant_method.empty()) return dtypeBits(mc.torch_dtype);
+        QuantFormat packed = checkpointFormat(mc);
+        return tensorBits(mc, packed, mc.quant_bits > 0 ? mc.quant_bits : packed.bits, nullptr, t);
+    }
+
+    if ((t.kind == TENSOR_TOKEN_EMBD && !qf.quantize_embeddings) || (t.kind == TENSOR_OUTPUT && !qf.quantize_lm_head)) {
+        return dtypeBits(mc.torch_dtype);
+    }
+    return bpw + (qf.group_size > 0 ? (qf.scale_bits + qf.zero_bits) / qf.group_size : 0);
+}
+
+
+struct RankEstimate {
+    int stage;
+    double weights;
+    double kv;
+    double activations;
+};
+
+// one tensor parallel rank of pipeline stage `stage`, vllm style: attention is split by heads, the mlp
+// by columns, embeddings and lm_head by vocab, norms and routers are replicated. when there are fewer
+// kv heads than ranks every rank keeps a whole kv head, so k/v (and the kv cache) get replicated.
+// compute_buf is the unsplit computeBuffer, priced once by the caller for every stage
+RankEstimate rankEstimate(const ModelConfig& mc, const QuantFormat& qf, double bpw, const GgufQuant* gq,
+    int context, int bsz, double compute_buf, int cache_bit, bool all_logits, int tp, int pp, int stage) {
+    int n_layer = mc.num_hidden_layers;
+    int first = stage * n_layer / pp;
+    int last = (stage + 1) * n_layer / pp;
+    bool first_stage = stage == 0;
+    bool last_stage = stage == pp - 1;
+    int kv_per_rank = max(1, (mc.num_key_value_heads + tp - 1) / tp);
+
+    RankEstimate re{ stage, 0, 0, 0 };
+    for (auto& t : tensorList(mc)) {
+        double share = 1.0 / tp;
+        bool here;
+        if (t.layer >= 0) {
+            here = t.layer >= first && t.layer < last;
+        }
+        else if (t.kind == TENSOR_TOKEN_EMBD) {
+            // tied weights are needed again by the lm_head on the last stage
+            here = first_stage || (last_stage && mc.tie_word_embeddings);
+        }
+        else {
+            here = last_stage;
+        }
+        if (!here) continue;
+
+        if (t.kind == TENSOR_NORM || t.kind == TENSOR_FFN_GATE_INP) share = 1;
+        if (t.kind == TENSOR_ATTN_K || t.kind == TENSOR_ATTN_V) share = (double)kv_per_rank / mc.num_key_value_heads;
+        re.weights += t.ne0 * t.ne1 * t.count * share * tensorBits(mc, qf, bpw, gq, t) / 8.0;
+    }
+
+    re.kv = 2.0 * kv_per_rank * mc.head_dim * (last - first) * (double)context * (cache_bit / 8.0);
+    re.activations = inBuffer(context, mc, bsz) + compute_buf / tp
+        + (last_stage ? outBuffer(mc, bsz, all_logits) / tp : 0);
+    return re;
+}
+
+
+double runtimeOverhead(const QuantFormat& qf, double model_size) {
+    return qf.fixed_overhead_mib * 1024 * 1024 + qf.overhead_ratio * model_size;
+}
+
+
+constexpr double GIB = 1024.0 * 1024 * 1024;
+
+// what the roofline model needs to know about a card. bandwidth and pcie in GB/s, dense fp16 tensor TFLOPS
+struct GpuProfile {
+    double vram_gib;
+    double bandwidth_gbs;
+    double fp16_tflops;
+    double pcie_gbs;
+};
+
+const map<string, GpuProfile> gpu_profiles{
+    {"t4", {16, 320, 65, 16}},
+    {"rtx3060", {12, 360, 51, 16}},
+    {"rtx3090", {24, 936, 71, 25}},
+    {"rtx4060ti", {16, 288, 44, 16}},
+    {"rtx4090", {24, 1008, 165, 25}},
+    {"rtx5090", {32, 1792, 210, 50}},
+    {"a10", {24, 600, 125, 25}},
+    {"l4", {24, 300, 121, 25}},
+    {"a6000", {48, 768, 155, 25}},
+    {"l40s", {48, 864, 362, 25}},
+    {"a100-40g", {40, 1555, 312, 25}},
+    {"a100-80g", {80, 2039, 312, 25}},
+    {"h100-pcie", {80, 2000, 756, 50}},
+    {"h100-sxm", {80, 3350, 989, 50}},
+    {"h200", {141, 4800, 989, 50}},
+    {"mi300x", {192, 5300, 1307, 50}}
+};
+
+
+// kernels don't run at the datasheet numbers
+constexpr double GPU_BW_EFF = 0.8, GPU_FLOPS_EFF = 0.5;
+
+// roofline time for one forward pass over n_tokens positions that each attend over context tokens.
+// the weights and kv_bytes of cache are streamed once per pass, the flops grow with the number of positions
+double decodeStepTime(const ModelConfig& mc, double weight_bytes, double kv_bytes, double context, int n_tokens, const GpuProfile& gpu) {
+    double attn_flops = 4.0 * mc.num_hidden_layers * context * mc.num_attention_heads * mc.head_dim;
+    double flops = n_tokens * (2.0 * mc.parameters + attn_flops);
+    return max((weight_bytes + kv_bytes) / (gpu.bandwidth_gbs * 1e9 * GPU_BW_EFF),
+        flops / (gpu.fp16_tflops * 1e12 * GPU_FLOPS_EFF));
+}
+
+
+// model catalog (catalog build / --catalog): a header, one column per field, then a string table.
+// the fields come from these lists, changing them means bumping CATALOG_VERSION
+#define CATALOG_ENCODER_COLUMNS(X, e) \
+    X(e.hidden_size) X(e.intermediate_size) X(e.num_hidden_layers) X(e.num_attention_heads) X(e.image_size) \
+    X(e.patch_size) X(e.merge_size) X(e.num_channels) X(e.tokens_per_image) X(e.projector_out)
+#define CATALOG_INT_COLUMNS(X) \
+    X(hidden_size) X(num_attention_heads) X(num_key_value_heads) X(num_hidden_layers) X(vocab_size) \
+    X(intermediate_size) X(head_dim) X(num_experts) X(expert_intermediate_size) X(gated_ffn) X(tie_word_embeddings) \
+    X(quant_group_size) CATALOG_ENCODER_COLUMNS(X, vision) CATALOG_ENCODER_COLUMNS(X, audio)
+#define CATALOG_DOUBLE_COLUMNS(X) X(parameters) X(quant_bits)
+#define CATALOG_STRING_COLUMNS(X) X(model_type) X(torch_dtype) X(quant_method)
+#define CATALOG_COUNT(field) +1
+
+constexpr uint32_t CATALOG_VERSION = 1;
+constexpr int CATALOG_INTS = 0 CATALOG_INT_COLUMNS(CATALOG_COUNT);
+// weights first, then the config's
+constexpr int CATALOG_DOUBLES = 1 CATALOG_DOUBLE_COLUMNS(CATALOG_COUNT);
+// name, revision, path, format, then the config's
+constexpr int CATALOG_STRINGS = 4 CATALOG_STRING_COLUMNS(CATALOG_COUNT);
+
+struct CatalogHeader {
+    char magic[8];            // "LLMCATLG"
+    uint32_t version;
+    uint32_t count;
+    uint32_t n_ints, n_doubles, n_strings, reserved;
+    uint64_t ints_offset;     // int32_t[n_ints][count]
+    uint64_t doubles_offset;  // double[n_doubles][count]
+    uint64_t refs_offset;     // uint32_t[n_strings][count], offsets into the string table
+    uint64_t strings_offset;  // nul terminated strings
+    uint64_t strings_size;
+};
+
+// a mapped catalog, entries are sorted by name then revision and read in place
+class Catalog {
+public:
+    explicit Catalog(const string& path) : file(path) {
+        size_t size = file.end() - file.begin();
+        header = reinterpret_cast<const CatalogHeader*>(file.begin());
+        if (size < sizeof(CatalogHeader) || memcmp(header->magic, "LLMCATLG", 8) != 0) {
+            throw runtime_error("Not a model catalog: " + path);
+        }
+        if (header->version != CATALOG_VERSION || header->n_ints != CATALOG_INTS || header->n_doubles != CATALOG_DOUBLES
+            || header->n_strings != CATALOG_STRINGS) {
+            throw runtime_error("Catalog was built by another version, rebuild it: " + path);
+        }
+        uint64_t n = header->count;
+        if (header->ints_offset + n * CATALOG_INTS * 4 > size || header->doubles_offset + n * CATALOG_DOUBLES * 8 > size
+            || header->refs_offset + n * CATALOG_STRINGS * 4 > size || header->strings_offset + header->strings_size > size
+            || (header->strings_size > 0 && file.begin()[header->strings_offset + header->strings_size - 1] != '\0')) {
+            throw runtime_error("Truncated model catalog: " + path);
+        }
+        ints = reinterpret_cast<const int32_t*>(file.begin() + header->ints_offset);
+        doubles = reinterpret_cast<const double*>(file.begin() + header->doubles_offset);
+        refs = reinterpret_cast<const uint32_t*>(file.begin() + header->refs_offset);
+        strings = file.begin() + header->strings_offset;
+        // the table ends in a nul, so any ref inside it reads a terminated string
+        for (uint64_t k = 0; k < n * CATALOG_STRINGS; k++) {
+            if (refs[k] >= header->strings_size) throw runtime_error("Corrupt model catalog: " + path);
+        }
+    }
+
+    size_t size() const { return header->count; }
+    string_view name(size_t i) const { return text(0, i); }
+    string_view revision(size_t i) const { return text(1, i); }
+    string_view path(size_t i) const { return text(2, i); }
+    string_view format(size_t i) const { return text(3, i); }
+    double weights(size_t i) const { return doubles[i]; }
+
+    // "name" or "name@revision", -1 when it isn't cataloged
+    long find(string_view key) const {
+        string_view rev;
+        size_t at = key.rfind('@');
+        if (at != string_view::npos) {
+            rev = key.substr(at + 1);
+            key = key.substr(0, at);
+        }
+        size_t lo = 0, hi = size();
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (name(mid) < key) lo = mid + 1;
+            else hi = mid;
+        }
+        for (; lo < size() && name(lo) == key; lo++) {
+            if (rev.empty() || revision(lo) == rev) return (long)lo;
+        }
+        return -1;
+    }
+
+    ModelConfig config(size_t i) const {
+        ModelConfig mc;
+        int column = 0;
+#define CATALOG_READ_INT(field) mc.field = static_cast<decltype(mc.field)>(ints[column++ * size() + i]);
+        CATALOG_INT_COLUMNS(CATALOG_READ_INT)
+#undef CATALOG_READ_INT
+        column = 1;
+#define CATALOG_READ_DOUBLE(field) mc.field = doubles[column++ * size() + i];
+        CATALOG_DOUBLE_COLUMNS(CATALOG_READ_DOUBLE)
+#undef CATALOG_READ_DOUBLE
+        column = 4;
+#define CATALOG_READ_STRING(field) mc.field = string(text(column++, i));
+        CATALOG_STRING_COLUMNS(CATALOG_READ_STRING)
+#undef CATALOG_READ_STRING
+        return mc;
+    }
+
+private:
+    string_view text(int column, size_t i) const { return strings + refs[column * size() + i]; }
+
+    MappedFile file;
+    const CatalogHeader* header{};
+    const int32_t* ints{};
+    const double* doubles{};
+    const uint32_t* refs{};
+    const char* strings{};
+};
+
+// set by --catalog, loadModelConfig resolves cataloged names through it
+const Catalog* active_catalog = nullptr;
+
+
+// popular configs compiled in from models.def, so their names work without a config.json
+struct BuiltinModel {
+    string_view name;
+    string_view model_type;
+    string_view torch_dtype;
+    int hidden_size;
+    int num_attention_heads;
+    int num_key_value_heads;
+    int num_hidden_layers;
+    int vocab_size;
+    int intermediate_size;
+    int head_dim;
+    int num_experts;
+    int expert_intermediate_size;
+    bool tie_word_embeddings;
+};
+
+constexpr BuiltinModel builtin_models[] = {
+#define MODEL(name, type, dtype, hidden, heads, kv_heads, layers, vocab, inter, head_dim, experts, expert_inter, tie) \
+    { name, type, dtype, hidden, heads, kv_heads, layers, vocab, inter, head_dim, experts, expert_inter, tie },
+#include "models.def"
+#undef MODEL
+};
+
+// case insensitive, nullptr when the name isn't built in
+constexpr const BuiltinModel* findBuiltinModel(string_view name) {
+    for (auto& m : builtin_models) {
+        if (iequals(m.name, name)) return &m;
+    }
+    return nullptr;
+}
+
+static_assert(findBuiltinModel("Qwen2.5-32B") != nullptr, "builtin model lookup is broken");
+
+ModelConfig builtinConfig(const BuiltinModel& m) {
+    ModelConfig mc;
+    mc.model_type = string(m.model_type);
+    mc.torch_dtype = string(m.torch_dtype);
+    mc.hidden_size = m.hidden_size;
+    mc.num_attention_heads = m.num_attention_heads;
+    mc.num_key_value_heads = m.num_key_value_heads;
+    mc.num_hidden_layers = m.num_hidden_layers;
+    mc.vocab_size = m.vocab_size;
+    mc.intermediate_size = m.intermediate_size;
+    mc.head_dim = m.head_dim;
+    mc.num_experts = m.num_experts;
+    mc.expert_intermediate_size = m.expert_intermediate_size > 0 ? m.expert_intermediate_size : m.intermediate_size;
+    mc.tie_word_embeddings = m.tie_word_embeddings;
+    mc.gated_ffn = findAdapter(mc.model_type).gated_ffn;
+    mc.parameters = tensorParams(tensorList(mc));
+    return mc;
+}
+
+
+// name is what the error messages call the config
+ModelConfig configFromJson(const json& configJson, double p, const string& name) {
+    ModelConfig mc;
+    try {
+        mc = parseConfig(configJson, p);
+    }
+    catch (exception& e) {
+        throw runtime_error(string("Error parsing model config: ") + e.what());
+    }
+
+    // 0 parameters = count them from the architecture
+    if (mc.parameters <= 0) {
+        mc.parameters = tensorParams(tensorList(mc));
+        if (mc.parameters <= 0) {
+            throw runtime_error("Parameter count not given and the config doesn't describe every tensor: " + name);
+        }
+    }
+    return mc;
+}
+
+
+ModelConfig loadModelConfig(const string& configPath, double p) {
+    // cataloged names never touch the config file
+    if (active_catalog != nullptr) {
+        long i = active_catalog->find(configPath);
+        if (i >= 0) {
+            ModelConfig mc = active_catalog->config(i);
+            if (p > 0) mc.parameters = p;
+            if (mc.parameters <= 0) {
+                throw runtime_error("Parameter count not given and the catalog doesn't have one: " + configPath);
+            }
+            return mc;
+        }
+    }
+    // then the built-in registry, a catalog can override a built-in name
+    if (const BuiltinModel* m = findBuiltinModel(configPath)) {
+        ModelConfig mc = builtinConfig(*m);
+        if (p > 0) mc.parameters = p;
+        return mc;
+    }
+
+    unique_ptr<MappedFile> file;
+    try {
+        file = make_unique<MappedFile>(configPath);
+    }
+    catch (exception&) {
+        throw runtime_error("Failed to open config file: " + configPath);
+    }
+
+    json configJson;
+    try {
+        configJson = parseConfigJson(file->begin(), file->end());
+    }
+    catch (exception& e) {
+        throw runtime_error(string("Failed to parse JSON: ") + e.what());
+    }
+
+    return configFromJson(configJson, p, configPath);
+}
+
+
+// "--name value" out of a subcommand's arguments, fallback when it isn't there
+string takeFlag(vector<string>& args, const string& name, const string& fallback = "") {
+    auto it = find(args.begin(), args.end(), name);
+    if (it == args.end() || it + 1 == args.end()) return fallback;
+    string value = *(it + 1);
+    args.erase(it, it + 2);
+    return value;
+}
+
+bool takeSwitch(vector<string>& args, const string& name) {
+    auto it = find(args.begin(), args.end(), name);
+    if (it == args.end()) return false;
+    args.erase(it);
+    return true;
+}
+
+
+// weights for any registered format, quant is a gguf preset name or a bpw ("0" = the format default)
+double formatModelSize(const ModelConfig& mc, string format, const string& quant) {
+    transform(format.begin(), format.end(), format.begin(), ::tolower);
+    auto it = quant_formats.find(format);
+    if (it == quant_formats.end()) {
+        throw runtime_error("Unsupported quant format: " + format);
+    }
+    const QuantFormat& qf = it->second;
+
+    if (qf.gguf_table) {
+        const GgufQuant* gq = findGgufQuant(quant);
+        if (gq == nullptr) {
+            throw runtime_error("Unknown gguf quant size: " + quant);
+        }
+        return ggufModelSize(mc, *gq);
+    }
+
+    double bpw = stod(quant);
+    return modelSize(mc, qf, bpw > 0 || qf.native_dtype ? bpw : qf.bits);
+}
+
+
+const GpuProfile& takeGpu(vector<string>& args, const string& default_gpu) {
+    string gpuName = takeFlag(args, "--gpu", default_gpu);
+    auto gpu = gpu_profiles.find(gpuName);
+    if (gpu == gpu_profiles.end()) {
+        throw runtime_error("Unknown gpu: " + gpuName);
+    }
+    return gpu->second;
+}
+
+// for callers that already resolved the gpu (they need more than its memory), --vram <GiB> wins over it. returns bytes
+double takeVram(vector<string>& args, const GpuProfile& gpu) {
+    string vram = takeFlag(args, "--vram");
+    return vram.empty() ? gpu.vram_gib * GIB : stod(vram) * GIB;
+}
+
+// --vram <GiB> wins over --gpu <name>, returns bytes
+double takeVram(vector<string>& args, const string& default_gpu) {
+    string vram = takeFlag(args, "--vram");
+    string gpuName = takeFlag(args, "--gpu", default_gpu);
+    if (!vram.empty()) {
+        return stod(vram) * GIB;
+    }
+    auto gpu = gpu_profiles.find(gpuName);
+    if (gpu == gpu_profiles.end()) {
+        throw runtime_error("Unknown gpu: " + gpuName);
+    }
+    return gpu->second.vram_gib * GIB;
+}
+
+
+// bumped whenever an estimate formula changes, so cached results from older builds stop matching
+constexpr uint32_t ESTIMATE_VERSION = 2;
+
+// 128 bit key from two independently seeded fnv-1a streams
+struct KeyHasher {
+    uint64_t a = 0xcbf29ce484222325ull;
+    uint64_t b = 0x84222325cbf29ce4ull;
+
+    KeyHasher& add(const void* data, size_t n) {
+        const unsigned char* p = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < n; i++) {
+            a = (a ^ p[i]) * 0x100000001b3ull;
+            b = (b ^ p[i]) * 0x100000001b3ull + (b >> 29);
+        }
+        return *this;
+    }
+    KeyHasher& add(string_view s) {
+        uint64_t n = s.size();
+        add(&n, sizeof(n));
+        return add(s.data(), s.size());
+    }
+    KeyHasher& add(double v) { return add(&v, sizeof(v)); }
+    KeyHasher& add(const EncoderConfig& e) {
+        for (int v : { e.hidden_size, e.intermediate_size, e.num_hidden_layers, e.num_attention_heads, e.image_size,
+            e.patch_size, e.merge_size, e.num_channels, e.tokens_per_image, e.projector_out }) add(v);
+        return *this;
+    }
+    // every field an estimate reads, whatever config layout it came from
+    KeyHasher& add(const ModelConfig& mc) {
+        for (int v : { mc.hidden_size, mc.num_attention_heads, mc.num_key_value_heads, mc.num_hidden_layers, mc.vocab_size,
+            mc.intermediate_size, mc.head_dim, mc.num_experts, mc.expert_intermediate_size, (int)mc.gated_ffn,
+            (int)mc.tie_word_embeddings, mc.quant_group_size }) add(v);
+        add(mc.model_type).add(mc.torch_dtype).add(mc.parameters).add(mc.quant_method).add(mc.quant_bits);
+        return add(mc.vision).add(mc.audio);
+    }
+    // formats can be redefined by --formats, so the definition is part of the key
+    KeyHasher& add(const QuantFormat& qf) {
+        add(qf.engine);
+        for (double v : { qf.bits, (double)qf.gguf_table, (double)qf.native_dtype, (double)qf.bpw_includes_overhead,
+            (double)qf.group_size, qf.scale_bits, qf.zero_bits, (double)qf.quantize_embeddings, (double)qf.quantize_lm_head,
+            qf.fixed_overhead_mib, qf.overhead_ratio }) add(v);
+        return *this;
+    }
+};
+
+struct CacheKey {
+    uint64_t a, b;
+};
+
+inline CacheKey cacheKey(KeyHasher h) {
+    h.add((double)ESTIMATE_VERSION);
+    // 0 marks an empty slot
+    return { h.a | 1, h.b };
+}
+
+
+// results that survive the process: a memory mapped file of fixed size slots that are only ever filled, never
+// changed. writers claim an empty slot with a compare-and-swap on its state word and publish it with a release
+// store, readers take ready slots without locking, so concurrent processes can share one file
+class EstimateCache {
+public:
+    static constexpr int VALUES = 8;
+    static constexpr uint64_t SLOTS = 1 << 16;
+
+    // an empty (or new) file is set up here, anything else has to already carry the magic and is never
+    // written to otherwise. the header goes in before the file is sized, so a full size file always has it
+    explicit EstimateCache(const string& path) {
+        size_t bytes = sizeof(Header) + SLOTS * sizeof(Slot);
+        uint64_t header[sizeof(Header) / sizeof(uint64_t)]{ MAGIC };
+        uint64_t magic = 0;
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+            OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) throw runtime_error("Failed to open estimate cache: " + path);
+        LARGE_INTEGER length{};
+        DWORD done = 0;
+        bool ok = GetFileSizeEx(file, &length) != 0;
+        if (ok && length.QuadPart == 0) {
+            ok = WriteFile(file, header, sizeof(header), &done, nullptr) && done == sizeof(header);
+            magic = MAGIC;
+        }
+        else if (ok) {
+            ok = ReadFile(file, &magic, sizeof(magic), &done, nullptr) && done == sizeof(magic);
+        }
+        if (!ok || magic != MAGIC) {
+            CloseHandle(file);
+            throw runtime_error("Not an estimate cache file (or an older layout): " + path);
+        }
+        // the mapping grows a file shorter than bytes
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, 0, (DWORD)bytes, nullptr);
+        void* p = mapping ? MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, bytes) : nullptr;
+        if (p == nullptr) {
+            if (mapping) CloseHandle(mapping);
+            CloseHandle(file);
+            throw runtime_error("Failed to map estimate cache: " + path);
+        }
+#else
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) throw runtime_error("Failed to open estimate cache: " + path);
+        struct stat st {};
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            throw runtime_error("Failed to open estimate cache: " + path);
+        }
+        if (st.st_size == 0) {
+            // racing creators write the same header and size, so either may win
+            if (pwrite(fd, header, sizeof(header), 0) != (ssize_t)sizeof(header)) {
+                close(fd);
+                throw runtime_error("Failed to write estimate cache: " + path);
+            }
+            magic = MAGIC;
+        }
+        else if (pread(fd, &magic, sizeof(magic), 0) != (ssize_t)sizeof(magic)) {
+            magic = 0;
+        }
+        if (magic != MAGIC) {
+            close(fd);
+            throw runtime_error("Not an estimate cache file (or an older layout): " + path);
+        }
+        // a creator may still be between the header and the resize, zero pages are empty slots either way
+        if ((st.st_size < (off_t)bytes && ftruncate(fd, bytes) != 0) || fstat(fd, &st) != 0 || st.st_size < (off_t)bytes) {
+            close(fd);
+            throw runtime_error("Failed to size estimate cache: " + path);
+        }
+        void* p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) throw runtime_error("Failed to map estimate cache: " + path);
+#endif
+        base = static_cast<char*>(p);
+        size = bytes;
+        slots = reinterpret_cast<Slot*>(base + sizeof(Header));
+    }
+
+    ~EstimateCache() {
+#ifdef _WIN32
+        UnmapViewOfFile(base);
+        CloseHandle(mapping);
+        CloseHandle(file);
+#else
+        munmap(base, size);
+#endif
+    }
+
+    EstimateCache(const EstimateCache&) = delete;
+    EstimateCache& operator=(const EstimateCache&) = delete;
+
+    bool lookup(CacheKey key, double* values) const {
+        for (uint64_t i = 0; i < MAX_PROBES; i++) {
+            const Slot& s = slots[(key.a + i) % SLOTS];
+            uint64_t state = s.state.load(memory_order_acquire);
+            if (state == EMPTY) return false;
+            if (state == READY && s.key_a == key.a && s.key_b == key.b) {
+                memcpy(values, s.values, sizeof(s.values));
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // a full probe window just means the result isn't cached
+    void insert(CacheKey key, const double* values) {
+        for (uint64_t i = 0; i < MAX_PROBES; i++) {
+            Slot& s = slots[(key.a + i) % SLOTS];
+            uint64_t state = EMPTY;
+            if (!s.state.compare_exchange_strong(state, WRITING, memory_order_acquire)) {
+                if (state == READY && s.key_a == key.a && s.key_b == key.b) return;
+                continue;
+            }
+            s.key_a = key.a;
+            s.key_b = key.b;
+            memcpy(s.values, values, sizeof(s.values));
+            s.state.store(READY, memory_order_release);
+            return;
+        }
+    }
+
+private:
+    static constexpr uint64_t MAGIC = 0x3145484341434c4cull;  // "LLCACHE1"
+    static constexpr uint64_t MAX_PROBES = 64;
+    enum : uint64_t { EMPTY = 0, WRITING = 1, READY = 2 };
+
+    struct Header {
+        atomic<uint64_t> magic;
+        uint64_t reserved[7];
+    };
+    struct Slot {
+        atomic<uint64_t> state;
+        uint64_t key_a, key_b;
+        double values[VALUES];
+    };
+    static_assert(atomic<uint64_t>::is_always_lock_free, "the cache file needs address free atomics");
+
+    char* base{};
+    size_t size{};
+    Slot* slots{};
+#ifdef _WIN32
+    HANDLE file{ INVALID_HANDLE_VALUE };
+    HANDLE mapping{};
+#endif
+};
+
+// set by --cache
+EstimateCache* estimate_cache = nullptr;
+
+
+struct Estimate {
+    double model_size{};
+    double context_size{};
+    double overhead{};
+    double multimodal{};
+    int image_tokens{};
+
+    double total() const { return model_size + context_size + overhead + multimodal; }
+};
+
+// the main estimate, quant is a gguf preset name or a bpw ("0" = the format default)
+Estimate estimateMemory(const ModelConfig& mc, string format, const string& quant, int context, int bsz, int cache_bit,
+    bool all_logits = false, int n_images = 1, int image_size = 0) {
+    transform(format.begin(), format.end(), format.begin(), ::tolower);
+    auto it = quant_formats.find(format);
+    if (it == quant_formats.end()) {
+        throw runtime_error("Unsupported quant format: " + format);
+    }
+    const QuantFormat& qf = it->second;
+
+    CacheKey key{};
+    if (estimate_cache != nullptr) {
+        KeyHasher h;
+        h.add("estimate").add(mc).add(format).add(qf).add(qf.gguf_table ? quant : to_string(stod(quant)));
+        for (int v : { context, bsz, cache_bit, (int)all_logits, n_images, image_size }) h.add(v);
+        key = cacheKey(h);
+        double v[EstimateCache::VALUES];
+        if (estimate_cache->lookup(key, v)) {
+            return { v[0], v[1], v[2], v[3], (int)v[4] };
+        }
+    }
+
+    Estimate e;
+    e.model_size = formatModelSize(mc, format, quant);
+    e.context_size = ctxSize(context, mc, bsz, cache_bit, all_logits);
+    e.overhead = runtimeOverhead(qf, e.model_size);
+    // mmproj files are f16, other engines keep the towers at the checkpoint dtype
+    int resolution = image_size > 0 ? image_size : (mc.vision.image_size > 0 ? mc.vision.image_size : 448);
+    e.multimodal = multimodalSize(mc, qf.native_dtype ? mc.get_dtype_divider() : 2.0, resolution, n_images, qf.gguf_table);
+    e.image_tokens = mc.vision.present() ? imageTokens(mc.vision, resolution) : 0;
+
+    if (estimate_cache != nullptr) {
+        double v[EstimateCache::VALUES] = { e.model_size, e.context_size, e.overhead, e.multimodal, (double)e.image_tokens };
+        estimate_cache->insert(key, v);
+    }
+    return e;
+}
+
+
+// the estimate as a polynomial in context, batch and slots, so a caller can evaluate it without us:
+// bytes = fixed + ctx * per_token + ctx * batch * per_token_batch + batch * per_batch + slots * per_slot
+// ctx is the whole cache (llama.cpp's -c, shared by the slots), the compute buffer stays at -ub 512
+struct CostCoefficients {
+    double fixed{};            // weights, overhead, multimodal towers, the ubatch part of the compute buffer
+    double per_token{};        // kv cache, K shift and the KQ scores of one ubatch
+    double per_token_batch{};  // KQ mask
+    double per_batch{};        // input tensors and logits reserved for a full batch
+    double per_slot{};         // one logits row per sequence decoded together
+
+    double at(double context, double bsz, double slots = 1) const {
+        return fixed + context * per_token + context * bsz * per_token_batch + bsz * per_batch + slots * per_slot;
+    }
+};
+
+// every buffer ctxSize adds up is affine in context and batch, so the coefficients are differences of the
+// same functions the estimate uses and at(ctx, bsz) reproduces it exactly
+CostCoefficients costCoefficients(const ModelConfig& mc, const string& format, const string& quant, int cache_bit,
+    bool all_logits = false, int n_images = 1, int image_size = 0) {
+    Estimate e = estimateMemory(mc, format, quant, 0, 512, cache_bit, all_logits, n_images, image_size);
+    double compute0 = computeBuffer(0, mc, 512);
+    double out0 = outBuffer(mc, 0, all_logits);
+
+    CostCoefficients c;
+    c.fixed = e.total() - e.context_size + compute0;
+    c.per_token = kvCache(1, mc, cache_bit) + inBuffer(1, mc, 0) + (computeBuffer(1, mc, 512) - compute0);
+    c.per_token_batch = inBuffer(1, mc, 1) - inBuffer(1, mc, 0) - inBuffer(0, mc, 1);
+    c.per_batch = inBuffer(0, mc, 1) + outBuffer(mc, 1, all_logits) - out0;
+    c.per_slot = out0;
+    return c;
+}
+
+// json, or a snippet for the admission controller to paste in: c (header), lua (module) or python
+void printCoefficients(const CostCoefficients& c, const string& style, const string& label) {
+    const pair<const char*, double> terms[] = {
+        { "fixed_bytes", c.fixed }, { "bytes_per_token", c.per_token }, { "bytes_per_token_batch", c.per_token_batch },
+        { "bytes_per_batch", c.per_batch }, { "bytes_per_slot", c.per_slot }
+    };
+    const char* formula = "fixed_bytes + ctx * bytes_per_token + ctx * batch * bytes_per_token_batch"
+        " + batch * bytes_per_batch + slots * bytes_per_slot";
+
+    if (style == "json") {
+        json out;
+        out["model"] = label;
+        for (auto& t : terms) out[t.first] = t.second;
+        out["formula"] = formula;
+        cout << out.dump(2) << endl;
+        return;
+    }
+
+    // doubles printed round trip exact
+    cout << setprecision(17);
+    if (style == "c") {
+        cout << "/* generated by llmcalculator --coefficients for " << label << " */\n"
+            << "#ifndef LLMCALC_COEFFICIENTS_H\n#define LLMCALC_COEFFICIENTS_H\n\n";
+        for (auto& t : terms) {
+            string name = t.first;
+            transform(name.begin(), name.end(), name.begin(), ::toupper);
+            // keep whole byte counts double literals, they can overflow an int
+            cout << "#define LLMCALC_" << name << " " << t.second << (t.second == floor(t.second) ? ".0" : "") << "\n";
+        }
+        cout << "\n/* " << formula << " */\n"
+            << "static inline double llmcalc_bytes(double ctx, double batch, double slots) {\n"
+            << "    return LLMCALC_FIXED_BYTES + ctx * LLMCALC_BYTES_PER_TOKEN + ctx * batch * LLMCALC_BYTES_PER_TOKEN_BATCH\n"
+            << "        + batch * LLMCALC_BYTES_PER_BATCH + slots * LLMCALC_BYTES_PER_SLOT;\n}\n\n#endif\n";
+    }
+    else if (style == "lua") {
+        cout << "-- generated by llmcalculator --coefficients for " << label << "\nlocal M = {\n";
+        for (auto& t : terms) cout << "  " << t.first << " = " << t.second << ",\n";
+        cout << "}\n\n-- " << formula << "\n"
+            << "function M.bytes(ctx, batch, slots)\n"
+            << "  return M.fixed_bytes + ctx * M.bytes_per_token + ctx * batch * M.bytes_per_token_batch\n"
+            << "    + batch * M.bytes_per_batch + slots * M.bytes_per_slot\n"
+            << "end\n\nreturn M\n";
+    }
+    else if (style == "python") {
+        cout << "# generated by llmcalculator --coefficients for " << label << "\n";
+        for (auto& t : terms) {
+            string name = t.first;
+            transform(name.begin(), name.end(), name.begin(), ::toupper);
+            cout << name << " = " << t.second << "\n";
+        }
+        cout << "\n\ndef bytes_needed(ctx, batch, slots=1):\n"
+            << "    return (FIXED_BYTES + ctx * BYTES_PER_TOKEN + ctx * batch * BYTES_PER_TOKEN_BATCH\n"
+            << "            + batch * BYTES_PER_BATCH + slots * BYTES_PER_SLOT)\n";
+    }
+    else {
+        throw runtime_error("Unknown coefficients output: " + style + " (json, c, lua or python)");
+    }
+}
+
+
+struct LoraConfig {
+    int r{};
+    double lora_alpha{};
+    vector<string> target_modules{};
+    map<string, int> rank_pattern{};   // per module rank overrides, keys are regexes over the full module name
+    vector<string> modules_to_save{};  // full trainable copies stored with the adapter
+};
+
+LoraConfig parseLoraConfig(const json& j) {
+    LoraConfig lc;
+    lc.r = j.value("r", 8);
+    lc.lora_alpha = j.value("lora_alpha", 8.0);
+    if (j.contains("target_modules")) {
+        // either a list of module names or a single string ("all-linear" or a regex)
+        if (j["target_modules"].is_array()) lc.target_modules = j["target_modules"].get<vector<string>>();
+        else if (j["target_modules"].is_string()) lc.target_modules = { j["target_modules"].get<string>() };
+    }
+    if (j.contains("rank_pattern") && j["rank_pattern"].is_object()) {
+        for (auto& item : j["rank_pattern"].items()) {
+            lc.rank_pattern[string(item.key())] = item.value().get<int>();
+        }
+    }
+    if (j.contains("modules_to_save") && j["modules_to_save"].is_array()) {
+        lc.modules_to_save = j["modules_to_save"].get<vector<string>>();
+    }
+    return lc;
+}
+
+// one module peft can wrap, named as in the checkpoint: the first "{}" is the layer index, a second one the
+// expert. fused modules (gpt2's c_attn, neox's query_key_value) cover several tensors with their outputs stacked
+struct LoraModule {
+    string path;
+    vector<TensorKind> kinds;
+};
+
+// keyed on model_type like arch_adapters, anything not listed is named like llama
+vector<LoraModule> loraModules(const ModelConfig& mc) {
+    const string& type = mc.model_type;
+    const vector<TensorKind> qkv{ TENSOR_ATTN_Q, TENSOR_ATTN_K, TENSOR_ATTN_V };
+
+    if (type == "gpt2" || type == "gpt_bigcode") {
+        return {
+            {"transformer.wte", {TENSOR_TOKEN_EMBD}},
+            {"transformer.h.{}.attn.c_attn", qkv},
+            {"transformer.h.{}.attn.c_proj", {TENSOR_ATTN_OUTPUT}},
+            {"transformer.h.{}.mlp.c_fc", {TENSOR_FFN_UP}},
+            {"transformer.h.{}.mlp.c_proj", {TENSOR_FFN_DOWN}},
+            {"lm_head", {TENSOR_OUTPUT}}
+        };
+    }
+    if (type == "gptj") {
+        return {
+            {"transformer.wte", {TENSOR_TOKEN_EMBD}},
+            {"transformer.h.{}.attn.q_proj", {TENSOR_ATTN_Q}},
+            {"transformer.h.{}.attn.k_proj", {TENSOR_ATTN_K}},
+            {"transformer.h.{}.attn.v_proj", {TENSOR_ATTN_V}},
+            {"transformer.h.{}.attn.out_proj", {TENSOR_ATTN_OUTPUT}},
+            {"transformer.h.{}.mlp.fc_in", {TENSOR_FFN_UP}},
+            {"transformer.h.{}.mlp.fc_out", {TENSOR_FFN_DOWN}},
+            {"lm_head", {TENSOR_OUTPUT}}
+        };
+    }
+    if (type == "falcon" || type == "RefinedWeb" || type == "RefinedWebModel" || type == "bloom") {
+        return {
+            {"transformer.word_embeddings", {TENSOR_TOKEN_EMBD}},
+            {"transformer.h.{}.self_attention.query_key_value", qkv},
+            {"transformer.h.{}.self_attention.dense", {TENSOR_ATTN_OUTPUT}},
+            {"transformer.h.{}.mlp.dense_h_to_4h", {TENSOR_FFN_UP}},
+            {"transformer.h.{}.mlp.dense_4h_to_h", {TENSOR_FFN_DOWN}},
+            {"lm_head", {TENSOR_OUTPUT}}
+        };
+    }
+    if (type == "gpt_neox") {
+        return {
+            {"gpt_neox.embed_in", {TENSOR_TOKEN_EMBD}},
+            {"gpt_neox.layers.{}.attention.query_key_value", qkv},
+            {"gpt_neox.layers.{}.attention.dense", {TENSOR_ATTN_OUTPUT}},
+            {"gpt_neox.layers.{}.mlp.dense_h_to_4h", {TENSOR_FFN_UP}},
+            {"gpt_neox.layers.{}.mlp.dense_4h_to_h", {TENSOR_FFN_DOWN}},
+            {"embed_out", {TENSOR_OUTPUT}}
+        };
+    }
+    if (type == "mpt") {
+        return {
+            {"transformer.wte", {TENSOR_TOKEN_EMBD}},
+            {"transformer.blocks.{}.attn.Wqkv", qkv},
+            {"transformer.blocks.{}.attn.out_proj", {TENSOR_ATTN_OUTPUT}},
+            {"transformer.blocks.{}.ffn.up_proj", {TENSOR_FFN_UP}},
+            {"transformer.blocks.{}.ffn.down_proj", {TENSOR_FFN_DOWN}}
+        };
+    }
+    if (type == "phi-msft") {
+        return {
+            {"transformer.embd.wte", {TENSOR_TOKEN_EMBD}},
+            {"transformer.h.{}.mixer.Wqkv", qkv},
+            {"transformer.h.{}.mixer.out_proj", {TENSOR_ATTN_OUTPUT}},
+            {"transformer.h.{}.mlp.fc1", {TENSOR_FFN_UP}},
+            {"transformer.h.{}.mlp.fc2", {TENSOR_FFN_DOWN}},
+            {"lm_head.linear", {TENSOR_OUTPUT}}
+        };
+    }
+    if (type == "phi" || type == "opt") {
+        string layer = type == "opt" ? "model.decoder.layers.{}." : "model.layers.{}.";
+        string mlp = type == "opt" ? "" : "mlp.";
+        return {
+            {type == "opt" ? "model.decoder.embed_tokens" : "model.embed_tokens", {TENSOR_TOKEN_EMBD}},
+            {layer + "self_attn.q_proj", {TENSOR_ATTN_Q}},
+            {layer + "self_attn.k_proj", {TENSOR_ATTN_K}},
+            {layer + "self_attn.v_proj", {TENSOR_ATTN_V}},
+            {layer + (type == "opt" ? "self_attn.out_proj" : "self_attn.dense"), {TENSOR_ATTN_OUTPUT}},
+            {layer + mlp + "fc1", {TENSOR_FFN_UP}},
+            {layer + mlp + "fc2", {TENSOR_FFN_DOWN}},
+            {"lm_head", {TENSOR_OUTPUT}}
+        };
+    }
+    if (type == "bert" || type == "roberta" || type == "xlm-roberta") {
+        string root = type == "bert" ? "bert" : "roberta";
+        return {
+            {root + ".embeddings.word_embeddings", {TENSOR_TOKEN_EMBD}},
+            {root + ".encoder.layer.{}.attention.self.query", {TENSOR_ATTN_Q}},
+            {root + ".encoder.layer.{}.attention.self.key", {TENSOR_ATTN_K}},
+            {root + ".encoder.layer.{}.attention.self.value", {TENSOR_ATTN_V}},
+            {root + ".encoder.layer.{}.attention.output.dense", {TENSOR_ATTN_OUTPUT}},
+            {root + ".encoder.layer.{}.intermediate.dense", {TENSOR_FFN_UP}},
+            {root + ".encoder.layer.{}.output.dense", {TENSOR_FFN_DOWN}}
+        };
+    }
+    if (type == "distilbert") {
+        return {
+            {"distilbert.embeddings.word_embeddings", {TENSOR_TOKEN_EMBD}},
+            {"distilbert.transformer.layer.{}.attention.q_lin", {TENSOR_ATTN_Q}},
+            {"distilbert.transformer.layer.{}.attention.k_lin", {TENSOR_ATTN_K}},
+            {"distilbert.transformer.layer.{}.attention.v_lin", {TENSOR_ATTN_V}},
+            {"distilbert.transformer.layer.{}.attention.out_lin", {TENSOR_ATTN_OUTPUT}},
+            {"distilbert.transformer.layer.{}.ffn.lin1", {TENSOR_FFN_UP}},
+            {"distilbert.transformer.layer.{}.ffn.lin2", {TENSOR_FFN_DOWN}}
+        };
+    }
+
+    vector<LoraModule> modules{
+        {"model.embed_tokens", {TENSOR_TOKEN_EMBD}},
+        {"lm_head", {TENSOR_OUTPUT}}
+    };
+    if (type == "phi3") {
+        modules.push_back({ "model.layers.{}.self_attn.qkv_proj", qkv });
+    }
+    else {
+        modules.push_back({ "model.layers.{}.self_attn.q_proj", {TENSOR_ATTN_Q} });
+        modules.push_back({ "model.layers.{}.self_attn.k_proj", {TENSOR_ATTN_K} });
+        modules.push_back({ "model.layers.{}.self_attn.v_proj", {TENSOR_ATTN_V} });
+    }
+    modules.push_back({ "model.layers.{}.self_attn.o_proj", {TENSOR_ATTN_OUTPUT} });
+    if (mc.num_experts > 0) {
+        string experts = type == "mixtral" ? "model.layers.{}.block_sparse_moe.experts.{}." : "model.layers.{}.mlp.experts.{}.";
+        bool w = type == "mixtral";
+        modules.push_back({ experts + (w ? "w1" : "gate_proj"), {TENSOR_FFN_GATE} });
+        modules.push_back({ experts + (w ? "w3" : "up_proj"), {TENSOR_FFN_UP} });
+        modules.push_back({ experts + (w ? "w2" : "down_proj"), {TENSOR_FFN_DOWN} });
+    }
+    else if (type == "phi3") {
+        modules.push_back({ "model.layers.{}.mlp.gate_up_proj", {TENSOR_FFN_GATE, TENSOR_FFN_UP} });
+        modules.push_back({ "model.layers.{}.mlp.down_proj", {TENSOR_FFN_DOWN} });
+    }
+    else {
+        modules.push_back({ "model.layers.{}.mlp.gate_proj", {TENSOR_FFN_GATE} });
+        modules.push_back({ "model.layers.{}.mlp.up_proj", {TENSOR_FFN_UP} });
+        modules.push_back({ "model.layers.{}.mlp.down_proj", {TENSOR_FFN_DOWN} });
+    }
+    return modules;
+}
+
+// fills the first "{}" of a module path
+string fillIndex(string path, int index) {
+    size_t at = path.find("{}");
+    if (at != string::npos) path.replace(at, 2, to_string(index));
+    return path;
+}
+
+// peft's name matching: a listed module matches a whole trailing path component, a single target string and
+// the rank_pattern keys are regexes (rank_pattern anchored at a component boundary like peft does)
+class LoraMatcher {
+public:
+    explicit LoraMatcher(const LoraConfig& lc) : config(lc) {
+        if (lc.target_modules.size() == 1 && lc.target_modules[0] != "all-linear") {
+            target_regex = compile(lc.target_modules[0], lc.target_modules[0]);
+        }
+        for (auto& rp : lc.rank_pattern) {
+            rank_regexes.push_back({ compile("(.*\\.)?(" + rp.first + ")", rp.first), rp.second });
+        }
+    }
+
+    // linear is false for the embeddings and the output head, which all-linear leaves alone
+    bool targets(const string& name, bool linear, int& rank) const {
+        rank = config.r;
+        bool hit = false;
+        if (config.target_modules.size() == 1 && config.target_modules[0] == "all-linear") hit = linear;
+        else if (target_regex) hit = regex_match(name, *target_regex);
+        else hit = endsWithModule(name, config.target_modules);
+        if (!hit) return false;
+
+        for (auto& rr : rank_regexes) {
+            if (regex_match(name, rr.first)) {
+                rank = rr.second;
+                break;
+            }
+        }
+        return true;
+    }
+
+    bool saves(const string& name) const {
+        return endsWithModule(name, config.modules_to_save);
+    }
+
+private:
+    const LoraConfig& config;
+    optional<regex> target_regex;
+    vector<pair<regex, int>> rank_regexes;
+
+    static regex compile(const string& pattern, const string& key) {
+        try {
+            return regex(pattern);
+        }
+        catch (regex_error&) {
+            throw runtime_error("Bad module pattern in adapter config: " + key);
+        }
+    }
+
+    static bool endsWithModule(const string& name, const vector<string>& modules) {
+        for (auto& m : modules) {
+            if (name == m) return true;
+            if (name.size() > m.size() && name.compare(name.size() - m.size(), m.size(), m) == 0
+                && name[name.size() - m.size() - 1] == '.') return true;
+        }
+        return false;
+    }
+};
+
+// A (r x ne0) + B (ne1 x r) for every targeted matrix, plus full copies of modules_to_save.
+// max_rank > 0 sizes a serving slot at that rank instead of the adapter's own. factored, when given, gets the
+// row + column count adafactor keeps for those same matrices
+double loraParams(const ModelConfig& mc, const LoraConfig& lc, int max_rank = 0, double* factored = nullptr) {
+    vector<TensorSpec> tensors = tensorList(mc);
+    // slot 0 holds the non repeating tensors
+    vector<vector<const TensorSpec*>> by_layer(mc.num_hidden_layers + 1);
+    for (auto& t : tensors) by_layer[t.layer + 1].push_back(&t);
+
+    LoraMatcher matcher(lc);
+    double total = 0;
+    for (auto& m : loraModules(mc)) {
+        bool per_layer = m.path.find("{}") != string::npos;
+        bool per_expert = per_layer && m.path.find("{}", m.path.find("{}") + 2) != string::npos;
+        bool linear = m.kinds[0] != TENSOR_TOKEN_EMBD && m.kinds[0] != TENSOR_OUTPUT;
+
+        for (int layer = per_layer ? 0 : -1; layer < (per_layer ? mc.num_hidden_layers : 0); layer++) {
+            double ne0 = 0, ne1 = 0;
+            int count = 0;
+            for (auto* t : by_layer[layer + 1]) {
+                if (find(m.kinds.begin(), m.kinds.end(), t->kind) == m.kinds.end()) continue;
+                ne0 = t->ne0;
+                ne1 += t->ne1;
+                count = t->count;
+            }
+            // eg gate_proj on a plain two matrix mlp
+            if (count == 0) continue;
+
+            string path = fillIndex(m.path, layer);
+            for (int e = 0; e < (per_expert ? count : 1); e++) {
+                string name = per_expert ? fillIndex(path, e) : path;
+                int copies = per_expert ? 1 : count;
+                int rank;
+                if (matcher.targets(name, linear, rank)) {
+                    int r = max_rank > 0 ? max_rank : rank;
+                    total += r * (ne0 + ne1) * copies;
+                    if (factored) *factored += (ne0 + ne1 + 2.0 * r) * copies;
+                }
+                if (matcher.saves(name)) {
+                    total += ne0 * ne1 * copies;
+                    if (factored) *factored += (ne0 + ne1) * copies;
+                }
+            }
+        }
+    }
+    return total;
+}
+
+
+/*
+lora adapter sizing and multi adapter serving capacity
+
+    lora <base_config> <base_params> <adapter_config.json> <quant_format> <bpw|quant_size> <ctx> <kv_cache_bit_size>
+        [--max-rank <r>] [--gpu <name> | --vram <GiB>]
+
+adapters are kept at 16 bits, every resident slot is sized at max rank (default: the adapter's own r)
+*/
+int loraMain(vector<string> args) {
+    int maxRank = 0;
+    double vram = 0;
+    try {
+        maxRank = stoi(takeFlag(args, "--max-rank", "0"));
+        vram = takeVram(args, "rtx4090");
+    }
+    catch (exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+
+    if (args.size() != 7) {
+        cerr << "Usage: lora <base_config> <base_params> <adapter_config.json> <quant_format> <bpw|quant_size> <ctx> <kv_cache_bit_size>"
+            << " [--max-rank <r>] [--gpu <name> | --vram <GiB>]" << endl;
+        return 1;
+    }
+
+    try {
+        ModelConfig mc = loadModelConfig(args[0], stod(args[1]) * 1e9);
+        if (tensorList(mc).empty()) {
+            throw runtime_error("Base config doesn't describe every tensor (intermediate_size/vocab_size), can't size the adapter");
+        }
+
+        LoraConfig lc = parseLoraConfig(readJsonFile(args[2], "adapter config"));
+        if (maxRank <= 0) maxRank = lc.r;
+
+        int context = stoi(args[5]);
+        int cache_bit = stoi(args[6]);
+        double base = formatModelSize(mc, args[3], args[4]);
+        double context_size = ctxSize(context, mc, 512, cache_bit);
+        double adapter = loraParams(mc, lc) * 2;
+        double slot = loraParams(mc, lc, maxRank) * 2;
+        double free_bytes = vram - base - context_size;
+        long long resident = free_bytes > 0 && slot > 0 ? (long long)(free_bytes / slot) : 0;
+
+        json out;
+        out["rank"] = lc.r;
+        out["alpha"] = lc.lora_alpha;
+        out["adapter_params"] = loraParams(mc, lc);
+        out["adapter_size"] = adapter / GIB;
+        out["max_rank"] = maxRank;
+        out["slot_size"] = slot / GIB;
+        out["base_size"] = base / GIB;
+        out["context_size"] = context_size / GIB;
+        out["free_for_adapters"] = max(free_bytes, 0.0) / GIB;
+        out["max_resident_adapters"] = resident;
+        cout << out.dump(2) << endl;
+    }
+    catch (exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
+
+
+// everything one data parallel rank holds while training
+struct TrainingMemory {
+    double weights{};
+    double gradients{};
+    double optimizer{};    // includes the fp32 master copy for full fine-tunes
+    double activations{};
+    double logits{};
+    double gather_buffer{}; // zero-3 all-gathers a layer's full parameters before using them
+};
+
+// bf16 activations saved for backward per token of one layer. with flash attention the s x s
+// scores are never stored, otherwise the softmax input and output are (Korthikanti et al.)
+double layerActivationBytes(const ModelConfig& mc, int seq_len, bool flash_attn) {
+    double h = mc.hidden_size;
+    double q = (double)mc.num_attention_heads * mc.head_dim;
+    double kv = (double)mc.num_key_value_heads * mc.head_dim;
+    double f = mc.num_experts > 0 ? mc.expert_intermediate_size : mc.intermediate_size;
+    double per_token = 2 * (6 * h + 2 * q + 2 * kv + (mc.gated_ffn ? 3 : 2) * f);
+    if (!flash_attn) {
+        per_token += 4.0 * mc.num_attention_heads * seq_len;
+    }
+    return per_token;
+}
+
+// method is full, lora or qlora; optimizer is adamw, adamw8bit or adafactor
+TrainingMemory trainingMemory(const ModelConfig& mc, const string& method, const string& optimizer, double trainable,
+    double factored, int seq_len, int micro_batch, bool checkpointing, bool flash_attn, int gpus, int zero) {
+    TrainingMemory tm;
+    bool full = method == "full";
+    double tokens = (double)seq_len * micro_batch;
+
+    // frozen or trained weights in bf16, qlora keeps the base in nf4
+    if (method == "qlora") tm.weights = modelSize(mc, quant_formats.at("nf4"), 4) + trainable * 4;
+    else if (full) tm.weights = mc.parameters * 2;
+    else tm.weights = mc.parameters * 2 + trainable * 4;
+
+    // full fine-tunes keep bf16 grads, adapters train in fp32
+    tm.gradients = trainable * (full ? 2 : 4);
+
+    double master = full ? trainable * 4 : 0;
+    if (optimizer == "adamw8bit") tm.optimizer = master + trainable * 2;
+    else if (optimizer == "adafactor") tm.optimizer = master + factored * 4;
+    else tm.optimizer = master + trainable * 8;
+
+    double per_layer = layerActivationBytes(mc, seq_len, flash_attn) * tokens;
+    if (checkpointing) {
+        // only layer inputs survive, one layer at a time gets recomputed in full
+        tm.activations = mc.num_hidden_layers * 2.0 * mc.hidden_size * tokens + per_layer;
+    }
+    else {
+        tm.activations = mc.num_hidden_layers * per_layer;
+    }
+    // bf16 logits, the fp32 upcast for the loss and its gradient
+    tm.logits = tokens * mc.vocab_size * (2 + 4 + 4);
+
+    // zero-1 shards optimizer states, zero-2 also gradients, zero-3 also the parameters
+    if (gpus > 1) {
+        if (zero >= 1) tm.optimizer /= gpus;
+        if (zero >= 2) tm.gradients /= gpus;
+        if (zero >= 3) {
+            tm.weights /= gpus;
+            tm.gather_buffer = 2.0 * mc.parameters / max(mc.num_hidden_layers, 1) * 2;
+        }
+    }
+    return tm;
+}
+
+
+/*
+fine-tuning memory per gpu
+
+    train <config> <params> <full|lora|qlora> <seq_len> <micro_batch>
+        [--optimizer adamw|adamw8bit|adafactor] [--checkpointing] [--no-flash-attn]
+        [--gpus <n>] [--zero <0-3>] [--adapter <adapter_config.json> | --rank <r>] [--gpu <name> | --vram <GiB>]
+
+mixed precision bf16. lora/qlora default to rank 16 on every linear layer when no adapter config is given
+*/
+int trainMain(vector<string> args) {
+    string optimizer = takeFlag(args, "--optimizer", "adamw");
+    bool checkpointing = takeSwitch(args, "--checkpointing");
+    bool flash_attn = !takeSwitch(args, "--no-flash-attn");
+    string adapterPath = takeFlag(args, "--adapter");
+    int gpus = 1, zero = 0, rank = 16;
+    double vram = 0;
+    try {
+        gpus = stoi(takeFlag(args, "--gpus", "1"));
+        zero = stoi(takeFlag(args, "--zero", "0"));
+        rank = stoi(takeFlag(args, "--rank", "16"));
+        vram = takeVram(args, "a100-80g");
+    }
+    catch (exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+
+    if (args.size() != 5 || gpus < 1 || zero < 0 || zero > 3) {
+        cerr << "Usage: train <config> <params> <full|lora|qlora> <seq_len> <micro_batch> [--optimizer adamw|adamw8bit|adafactor]"
+            << " [--checkpointing] [--no-flash-attn] [--gpus <n>] [--zero <0-3>] [--adapter <adapter_config.json> | --rank <r>]"
+            << " [--gpu <name> | --vram <GiB>]" << endl;
+        return 1;
+    }
+    string method = args[2];
+    if (method != "full" && method != "lora" && method != "qlora") {
+        cerr << "Unknown training method (" << method << "), use full, lora or qlora." << endl;
+        return 1;
+    }
+    if (optimizer != "adamw" && optimizer != "adamw8bit" && optimizer != "adafactor") {
+        cerr << "Unknown optimizer (" << optimizer << "), use adamw, adamw8bit or adafactor." << endl;
+        return 1;
+    }
+
+    try {
+        ModelConfig mc = loadModelConfig(args[0], stod(args[1]) * 1e9);
+        vector<TensorSpec> tensors = tensorList(mc);
+        if (tensors.empty()) {
+            throw runtime_error("Config doesn't describe every tensor (intermediate_size/vocab_size), can't size training");
+        }
+
+        // trainable params, and the row + column count adafactor keeps per matrix instead
+        double trainable = 0, factored = 0;
+        if (method == "full") {
+            trainable = mc.parameters;
+            for (auto& t : tensors) factored += (t.ne0 + t.ne1) * t.count;
+        }
+        else {
+            LoraConfig lc;
+            if (!adapterPath.empty()) {
+                lc = parseLoraConfig(readJsonFile(adapterPath, "adapter config"));
+            }
+            else {
+                lc.r = rank;
+                lc.target_modules = { "all-linear" };
+            }
+            // A is r x ne0 and B is ne1 x r, each factored into rows + columns
+            trainable = loraParams(mc, lc, 0, &factored);
+        }
+
+        TrainingMemory tm = trainingMemory(mc, method, optimizer, trainable, factored, stoi(args[3]), stoi(args[4]),
+            checkpointing, flash_attn, gpus, zero);
+        double total = tm.weights + tm.gradients + tm.optimizer + tm.activations + tm.logits + tm.gather_buffer;
+
+        json out;
+        out["trainable_params"] = trainable;
+        out["weights"] = tm.weights / GIB;
+        out["gradients"] = tm.gradients / GIB;
+        out["optimizer_states"] = tm.optimizer / GIB;
+        out["activations"] = tm.activations / GIB;
+        out["logits"] = tm.logits / GIB;
+        out["zero3_gather_buffer"] = tm.gather_buffer / GIB;
+        out["total_per_gpu"] = total / GIB;
+        out["fits"] = total <= vram;
+        cout << out.dump(2) << endl;
+    }
+    catch (exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
+
+
+// one way to deploy a model: quant + kv type and what that costs on a single gpu
+struct PackCandidate {
+    string quant;
+    int kv_bits;
+    double bytes;
+};
+
+struct PackModel {
+    string name;
+    vector<PackCandidate> candidates; // best quality first
+};
+
+struct PackGpu {
+    string host;
+    int index;
+    string type;
+    double capacity;
+    double used;
+    vector<pair<int, int>> placed; // (model, candidate)
+};
+
+// objective "gpus" = fewest gpus then best quality, "headroom" = largest worst case free memory
+struct PackScore {
+    int gpus;
+    double min_free;
+    int quality_penalty;
+};
+
+PackScore packScore(const vector<PackGpu>& gpus) {
+    PackScore score{ 0, 1e300, 0 };
+    for (auto& g : gpus) {
+        if (g.placed.empty()) continue;
+        score.gpus++;
+        score.min_free = min(score.min_free, g.capacity - g.used);
+        for (auto& p : g.placed) score.quality_penalty += p.second;
+    }
+    return score;
+}
+
+bool packBetter(const PackScore& a, const PackScore& b, bool headroom) {
+    if (headroom) {
+        if (a.min_free != b.min_free) return a.min_free > b.min_free;
+        if (a.gpus != b.gpus) return a.gpus < b.gpus;
+    }
+    else if (a.gpus != b.gpus) {
+        return a.gpus < b.gpus;
+    }
+    return a.quality_penalty < b.quality_penalty;
+}
+
+// biggest models first. "gpus" packs every model at its smallest candidate (tightest fit on a gpu already in use,
+// the smallest fresh gpu that fits when nothing open has room), then upgrades each model in place to the best
+// candidate its gpu still has room for, so a big model's best quant never costs the co-location of later ones.
+// "headroom" spreads instead: best candidate onto whichever gpu keeps the most memory free
+void packHeuristic(const vector<PackModel>& models, vector<PackGpu>& gpus, bool headroom, vector<int>& unplaced) {
+    vector<int> order(models.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = (int)i;
+    sort(order.begin(), order.end(), [&](int a, int b) {
+        return models[a].candidates.front().bytes > models[b].candidates.front().bytes;
+    });
+
+    if (headroom) {
+        for (int m : order) {
+            bool placed = false;
+            for (size_t c = 0; c < models[m].candidates.size() && !placed; c++) {
+                double need = models[m].candidates[c].bytes;
+                int pick = -1;
+                double pick_free = 0;
+                for (size_t g = 0; g < gpus.size(); g++) {
+                    double free_after = gpus[g].capacity - gpus[g].used - need;
+                    if (free_after < 0) continue;
+                    if (pick < 0 || free_after > pick_free) {
+                        pick = (int)g;
+                        pick_free = free_after;
+                    }
+                }
+                if (pick >= 0) {
+                    gpus[pick].used += need;
+                    gpus[pick].placed.push_back({ m, (int)c });
+                    placed = true;
+                }
+            }
+            if (!placed) unplaced.push_back(m);
+        }
+        return;
+    }
+
+    for (int m : order) {
+        const vector<PackCandidate>& cands = models[m].candidates;
+        int c = (int)(min_element(cands.begin(), cands.end(), [](auto& a, auto& b) { return a.bytes < b.bytes; }) - cands.begin());
+        double need = cands[c].bytes;
+        int pick = -1;
+        double pick_free = 0;
+        // pass 0 = gpus in use, pass 1 = fresh ones
+        for (int pass = 0; pass < 2 && pick < 0; pass++) {
+            for (size_t g = 0; g < gpus.size(); g++) {
+                if (gpus[g].placed.empty() == (pass == 0)) continue;
+                double free_after = gpus[g].capacity - gpus[g].used - need;
+                if (free_after < 0) continue;
+                if (pick < 0 || free_after < pick_free) {
+                    pick = (int)g;
+                    pick_free = free_after;
+                }
+            }
+        }
+        if (pick < 0) {
+            unplaced.push_back(m);
+            continue;
+        }
+        gpus[pick].used += need;
+        gpus[pick].placed.push_back({ m, c });
+    }
+
+    // upgrades only take memory, so one pass in the same order settles it
+    for (int m : order) {
+        for (auto& g : gpus) {
+            for (auto& p : g.placed) {
+                if (p.first != m) continue;
+                double current = models[m].candidates[p.second].bytes;
+                for (int c = 0; c < p.second; c++) {
+                    double need = models[m].candidates[c].bytes;
+                    if (g.used - current + need > g.capacity) continue;
+                    g.used += need - current;
+                    p.second = c;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+// search nodes packExact may visit before giving up, candidates x gpus can blow up well below 12 models
+constexpr long PACK_MAX_NODES = 20000000;
+
+// depth first over (model, candidate, gpu) with the heuristic result as the first bound. empty
+// gpus of the same type and capacity are interchangeable, so only the first of them is tried.
+// false when the node budget ran out before the search finished
+bool packExact(const vector<PackModel>& models, size_t m, vector<PackGpu>& gpus, bool headroom,
+    vector<PackGpu>& best, PackScore& bestScore, long& nodes) {
+    if (++nodes > PACK_MAX_NODES) return false;
+    PackScore current = packScore(gpus);
+    if (!headroom && current.gpus > bestScore.gpus) return true;
+    if (headroom && current.gpus > 0 && current.min_free < bestScore.min_free) return true;
+
+    if (m == models.size()) {
+        if (packBetter(current, bestScore, headroom)) {
+            bestScore = current;
+            best = gpus;
+        }
+        return true;
+    }
+
+    for (size_t c = 0; c < models[m].candidates.size(); c++) {
+        double need = models[m].candidates[c].bytes;
+        vector<pair<string, double>> tried_empty;
+        for (auto& g : gpus) {
+            if (g.capacity - g.used < need) continue;
+            if (g.placed.empty()) {
+                pair<string, double> kind{ g.type, g.capacity };
+                if (find(tried_empty.begin(), tried_empty.end(), kind) != tried_empty.end()) continue;
+                tried_empty.push_back(kind);
+            }
+            g.used += need;
+            g.placed.push_back({ (int)m, (int)c });
+            bool done = packExact(models, m + 1, gpus, headroom, best, bestScore, nodes);
+            g.placed.pop_back();
+            g.used -= need;
+            if (!done) return false;
+        }
+    }
+    return true;
+}
+
+
+/*
+fleet placement
+
+    pack <inventory.json> <models.json> [--objective gpus|headroom] [--exact] [--reserve <GiB>]
+
+inventory: {"hosts": [{"name": "node1", "gpus": [{"type": "a100-80g", "count": 4}, {"vram_gib": 24}]}]}
+models:    {"models": [{"name": "...", "config": "config.json", "params": 32.8, "context": 16384, "concurrency": 4,
+                        "format": "gguf", "quants": ["Q5_K_M", "Q4_K_M"], "kv_bits": [16, 8]}]}
+
+every model lands on a single gpu, --exact runs branch and bound (12 models at most, the heuristic placement
+stays when the search outgrows its node budget)
+*/
+int packMain(vector<string> args) {
+    string objective = takeFlag(args, "--objective", "gpus");
+    bool exact = takeSwitch(args, "--exact");
+    double reserve = 0;
+    try {
+        reserve = stod(takeFlag(args, "--reserve", "0.5")) * GIB;
+    }
+    catch (exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+    if (args.size() != 2 || (objective != "gpus" && objective != "headroom")) {
+        cerr << "Usage: pack <inventory.json> <models.json> [--objective gpus|headroom] [--exact] [--reserve <GiB>]" << endl;
+        return 1;
+    }
+    bool headroom = objective == "headroom";
+
+    vector<PackGpu> gpus;
+    vector<PackModel> models;
+    try {
+        json inventory = readJsonFile(args[0], "inventory");
+        for (auto& host : inventory.at("hosts")) {
+            int index = 0;
+            for (auto& g : host.at("gpus")) {
+                string type = g.value("type", string("custom"));
+                if (!g.contains("vram_gib") && !gpu_profiles.count(type)) throw runtime_error("Unknown gpu type in inventory: " + type);
+                double vram = g.contains("vram_gib") ? g["vram_gib"].get<double>() : gpu_profiles.at(type).vram_gib;
+                for (int i = 0; i < g.value("count", 1); i++) {
+                    gpus.push_back({ host.value("name", string("host")), index++, type, vram * GIB - reserve, 0, {} });
+                }
+            }
+        }
+
+        json modelList = readJsonFile(args[1], "model list");
+        for (auto& entry : modelList.at("models")) {
+            ModelConfig mc = loadModelConfig(entry.at("config").get<string>(), entry.value("params", 0.0) * 1e9);
+            string format = entry.value("format", string("gguf"));
+            transform(format.begin(), format.end(), format.begin(), ::tolower);
+            if (quant_formats.count(format) == 0) throw runtime_error("Unsupported quant format: " + format);
+            const QuantFormat& qf = quant_formats.at(format);
+            vector<string> quants = entry.value("quants", qf.gguf_table
+                ? vector<string>{ "Q8_0", "Q6_K", "Q5_K_M", "Q4_K_M" } : vector<string>{ "0" });
+            vector<int> kv_bits = entry.value("kv_bits", vector<int>{ 16, 8 });
+            // llama.cpp splits -c between the -np slots, so every concurrent user gets the full context
+            int context = entry.value("context", 8192) * entry.value("concurrency", 1);
+
+            int resolution = mc.vision.image_size > 0 ? mc.vision.image_size : 448;
+            double mm_size = multimodalSize(mc, qf.native_dtype ? mc.get_dtype_divider() : 2.0, resolution, 1, qf.gguf_table);
+
+            PackModel pm;
+            pm.name = entry.value("name", entry.at("config").get<string>());
+            vector<pair<double, PackCandidate>> ranked;
+            for (auto& q : quants) {
+                double weights = formatModelSize(mc, format, q);
+                double width = qf.gguf_table ? findGgufQuant(q)->bpw : stod(q);
+                for (int kv : kv_bits) {
+                    double bytes = weights + ctxSize(context, mc, 512, kv) + runtimeOverhead(qf, weights) + mm_size;
+                    ranked.push_back({ width * 100 + kv, { q, kv, bytes } });
+                }
+            }
+            sort(ranked.begin(), ranked.end(), [](auto& a, auto& b) { return a.first > b.first; });
+            for (auto& r : ranked) pm.candidates.push_back(r.second);
+            if (pm.candidates.empty()) throw runtime_error("No quant/kv candidates for " + pm.name);
+            models.push_back(pm);
+        }
+    }
+    catch (exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+
+    vector<int> unplaced;
+    vector<PackGpu> result = gpus;
+    packHeuristic(models, result, headroom, unplaced);
+    string solver = "heuristic";
+
+    if (exact) {
+        if (models.size() > 12) {
+            cerr << "Warning: " << models.size() << " models is too many for the exact solver, keeping the heuristic placement" << endl;
+        }
+        else if (!unplaced.empty()) {
+            cerr << "Warning: some models fit nowhere, keeping the heuristic placement" << endl;
+        }
+        else {
+            PackScore bestScore = packScore(result);
+            vector<PackGpu> work = gpus;
+            vector<PackGpu> best = result;
+            long nodes = 0;
+            if (packExact(models, 0, work, headroom, best, bestScore, nodes)) {
+                result = best;
+                solver = "exact";
+            }
+            else {
+                cerr << "Warning: the exact search hit its node limit, keeping the heuristic placement" << endl;
+            }
+        }
+    }
+
+    json out;
+    out["solver"] = solver;
+    out["objective"] = objective;
+    out["gpus_used"] = packScore(result).gpus;
+    out["placements"] = json::array();
+    for (auto& g : result) {
+        if (g.placed.empty()) continue;
+        json gj;
+        gj["host"] = g.host;
+        gj["gpu"] = g.index;
+        gj["type"] = g.type;
+        gj["used"] = g.used / GIB;
+        gj["free"] = (g.capacity - g.used) / GIB;
+        gj["models"] = json::array();
+        for (auto& p : g.placed) {
+            const PackCandidate& c = models[p.first].candidates[p.second];
+            gj["models"].push_back({ {"name", models[p.first].name}, {"quant", c.quant}, {"kv_bits", c.kv_bits}, {"size", c.bytes / GIB} });
+        }
+        out["placements"].push_back(gj);
+    }
+    out["unplaced"] = json::array();
+    for (int m : unplaced) out["unplaced"].push_back(models[m].name);
+    cout << out.dump(2) << endl;
+    return unplaced.empty() ? 0 : 2;
+}
+
+
+// llama.cpp cache types, bits per element including the block scales
+const vector<pair<string, double>> llama_cache_types{ {"f16", 16}, {"q8_0", 8.5}, {"q4_0", 4.5} };
+
+struct TuneResult {
+    int ngl, ctx, batch, ubatch, parallel;
+    string ctk, ctv;
+    bool flash_attn;
+    double vram, decode_tps, ttft;
+};
+
+// the largest -c tune searches, well past any model's window and small enough that doubling stays in an int
+constexpr int TUNE_MAX_CTX = 1 << 24;
+
+
+/*
+llama.cpp launch flag autotuner
+
+    tune <config> <params> <quant_size> [--gpu <name>] [--vram <GiB>] [--host-bw <GB/s>] [--min-ctx <n>] [--max-ctx <n>]
+        [--prompt <tokens>] [--objective tps|users] [--ttft-ms <slo>] [--reserve <GiB>]
+
+searches -ngl -c -ub -ctk -ctv -fa -np, every slot gets at least --min-ctx tokens. tps maximizes total
+decode tokens/s, users maximizes -np while a burst of -np prompts still prefills within --ttft-ms.
+q4_0 caches are only used when f16/q8_0 would cost gpu layers (or slots)
+*/
+int tuneMain(vector<string> args) {
+    string gpuName = takeFlag(args, "--gpu", "rtx4090");
+    string vramStr = takeFlag(args, "--vram");
+    string objective = takeFlag(args, "--objective", "tps");
+    double host_bw = 0, ttft_slo = 0, reserve = 0, vram = 0;
+    int min_ctx = 0, max_ctx = 0, prompt = 0;
+    try {
+        vram = vramStr.empty() ? 0 : stod(vramStr);
+        host_bw = stod(takeFlag(args, "--host-bw", "60")) * 1e9;
+        min_ctx = stoi(takeFlag(args, "--min-ctx", "4096"));
+        max_ctx = stoi(takeFlag(args, "--max-ctx", "0"));
+        prompt = stoi(takeFlag(args, "--prompt", "1024"));
+        ttft_slo = stod(takeFlag(args, "--ttft-ms", "2000")) / 1000;
+        reserve = stod(takeFlag(args, "--reserve", "0.5")) * GIB;
+    }
+    catch (exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+    if (max_ctx <= 0) max_ctx = max(min_ctx, 32768);
+    if (min_ctx < 1) {
+        cerr << "Min context has to be at least 1." << endl;
+        return 1;
+    }
+    if (max_ctx > TUNE_MAX_CTX) {
+        cerr << "Max context can't be above " << TUNE_MAX_CTX << "." << endl;
+        return 1;
+    }
+    if (min_ctx > max_ctx) {
+        cerr << "Min context (" << min_ctx << ") is above max context (" << max_ctx << ")." << endl;
+        return 1;
+    }
+    auto gpu = gpu_profiles.find(gpuName);
+    if (args.size() != 3 || gpu == gpu_profiles.end() || (objective != "tps" && objective != "users")) {
+        cerr << "Usage: tune <config> <params> <quant_size> [--gpu <name>] [--vram <GiB>] [--host-bw <GB/s>] [--min-ctx <n>] [--max-ctx <n>]"
+            << " [--prompt <tokens>] [--objective tps|users] [--ttft-ms <slo>] [--reserve <GiB>]" << endl;
+        return 1;
+    }
+    GpuProfile hw = gpu->second;
+    if (!vramStr.empty()) hw.vram_gib = vram;
+    double budget = hw.vram_gib * GIB - reserve;
+
+    ModelConfig mc;
+    const GgufQuant* gq = findGgufQuant(args[2]);
+    try {
+        mc = loadModelConfig(args[0], stod(args[1]) * 1e9);
+        if (gq == nullptr) throw runtime_error("Unknown gguf quant size: " + args[2]);
+        if (tensorList(mc).empty()) throw runtime_error("Config doesn't describe every tensor (intermediate_size/vocab_size), can't tune offload");
+    }
+    catch (exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+    // per layer weights, the output head (offloaded as the last -ngl step) and token_embd (always on the host)
+    int n_layer = mc.num_hidden_layers;
+    vector<double> layer_bytes(n_layer, 0);
+    double output_bytes = 0, embd_bytes = 0;
+    for (auto& t : tensorList(mc)) {
+        double bytes = t.ne0 * t.ne1 * t.count * ggml_type_bits[ggufTensorType(*gq, t, mc)] / 8.0;
+        if (t.layer >= 0) layer_bytes[t.layer] += bytes;
+        else if (t.kind == TENSOR_TOKEN_EMBD) embd_bytes += bytes;
+        else output_bytes += bytes;
+    }
+    if (mc.tie_word_embeddings) output_bytes += embd_bytes;
+    double total_weights = embd_bytes + output_bytes - (mc.tie_word_embeddings ? embd_bytes : 0);
+    for (double b : layer_bytes) total_weights += b;
+
+    double gpu_flops = hw.fp16_tflops * 1e12 * GPU_FLOPS_EFF;
+    double pcie = hw.pcie_gbs * 1e9;
+
+    // -b only splits into -ub sized graphs: it costs no vram and doesn't change the modelled speed, so it's
+    // llama.cpp's default rather than a search axis
+    auto search = [&](const vector<pair<string, double>>& cache_types) {
+        optional<TuneResult> best;
+        for (int ctx = min_ctx; ctx <= max_ctx; ctx *= 2) {
+            for (int parallel : { 1, 2, 4, 8, 16, 32 }) {
+                if (ctx / parallel < min_ctx) break;
+                for (int ubatch : { 128, 256, 512, 1024, 2048 }) {
+                    int batch = max(2048, ubatch);
+                    for (bool fa : { false, true }) {
+                        for (auto& ctk : cache_types) {
+                            for (auto& ctv : cache_types) {
+                                // quantized v cache needs flash attention
+                                if (ctv.first != "f16" && !fa) continue;
+
+                                double kv_layer = (double)mc.num_key_value_heads * mc.head_dim * ctx * (ctk.second + ctv.second) / 8.0;
+                                // the graph (and its result_output logits) is reserved per ubatch, the output buffer
+                                // keeps one row of logits per sequence
+                                double buffers = ubatchComputeBuffer(ctx, mc, ubatch, fa) + inBuffer(ctx, mc, ubatch)
+                                    + (double)mc.vocab_size * ubatch * 4 + (double)mc.vocab_size * parallel * 4;
+
+                                // the most layers that still fit, the output head goes last
+                                double used = buffers;
+                                int ngl = 0;
+                                double gpu_weights = 0;
+                                for (; ngl < n_layer && used + layer_bytes[ngl] + kv_layer <= budget; ngl++) {
+                                    used += layer_bytes[ngl] + kv_layer;
+                                    gpu_weights += layer_bytes[ngl];
+                                }
+                                if (ngl == 0) continue;
+                                if (ngl == n_layer && used + output_bytes <= budget) {
+                                    used += output_bytes;
+                                    gpu_weights += output_bytes;
+                                    ngl++;
+                                }
+                                int gpu_layers = min(ngl, n_layer);
+                                double cpu_weights = total_weights - gpu_weights - embd_bytes;
+
+                                // decode: one step serves every slot, slots sit half full on average. host
+                                // resident layers add their own streaming time on top of the gpu's pass
+                                double kv_read = kv_layer / 2;
+                                double step = decodeStepTime(mc, gpu_weights, gpu_layers * kv_read, ctx / parallel / 2.0, parallel, hw)
+                                    + (cpu_weights + (n_layer - gpu_layers) * kv_read) / host_bw;
+                                double decode_tps = parallel / step;
+
+                                // prefill of a burst of -np prompts: host resident layers are copied over pcie once per
+                                // ubatch, and matmuls need a few hundred rows before they run at full speed
+                                double tokens = (double)prompt * (objective == "users" ? parallel : 1);
+                                double ubatches = ceil(tokens / ubatch);
+                                double prefill_flops = gpu_flops * min(1.0, ubatch / 512.0);
+                                double ttft = tokens * 2.0 * mc.parameters / prefill_flops + ubatches * cpu_weights / pcie;
+
+                                if (objective == "users" && ttft > ttft_slo) continue;
+
+                                TuneResult r{ ngl, ctx, batch, ubatch, parallel, ctk.first, ctv.first, fa, used, decode_tps, ttft };
+                                bool better;
+                                if (!best) better = true;
+                                else if (objective == "users" && r.parallel != best->parallel) better = r.parallel > best->parallel;
+                                // same speed: prefer the larger context, then the faster prefill, then the least vram
+                                else if (fabs(r.decode_tps - best->decode_tps) > best->decode_tps * 1e-6) better = r.decode_tps > best->decode_tps;
+                                else if (r.ctx != best->ctx) better = r.ctx > best->ctx;
+                                else if (fabs(r.ttft - best->ttft) > best->ttft * 1e-6) better = r.ttft < best->ttft;
+                                else better = r.vram < best->vram;
+                                if (better) best = r;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+        return best;
+    };
+
+    // a smaller cache always reads faster, and the model has no quality term, so q4_0 is only picked when the
+    // f16/q8_0 caches would cost gpu layers (or, for users, slots)
+    optional<TuneResult> any = search(llama_cache_types);
+    optional<TuneResult> lossless = search({ llama_cache_types[0], llama_cache_types[1] });
+    if (!any) {
+        cerr << "Nothing fits: not even one layer with " << min_ctx << " tokens of context (or the ttft slo is too tight)." << endl;
+        return 1;
+    }
+    TuneResult best = *any;
+    if (lossless && lossless->ngl >= any->ngl && (objective != "users" || lossless->parallel >= any->parallel)) best = *lossless;
+
+    stringstream cmd;
+    cmd << "llama-server -m <model.gguf> -ngl " << best.ngl << " -c " << best.ctx << " -b " << best.batch << " -ub " << best.ubatch
+        << " -ctk " << best.ctk << " -ctv " << best.ctv << " -fa " << (best.flash_attn ? "on" : "off") << " -np " << best.parallel;
+
+    json out;
+    out["command"] = cmd.str();
+    out["ngl"] = best.ngl;
+    out["offloaded_all"] = best.ngl > n_layer;
+    out["ctx"] = best.ctx;
+    out["ctx_per_slot"] = best.ctx / best.parallel;
+    out["batch"] = best.batch;
+    out["ubatch"] = best.ubatch;
+    out["cache_type_k"] = best.ctk;
+    out["cache_type_v"] = best.ctv;
+    out["flash_attn"] = best.flash_attn;
+    out["parallel"] = best.parallel;
+    out["vram"] = best.vram / GIB;
+    out["decode_tokens_per_s"] = best.decode_tps;
+    out["decode_tokens_per_s_per_user"] = best.decode_tps / best.parallel;
+    out["ttft_ms"] = best.ttft * 1000;
+    cout << out.dump(2) << endl;
+    return 0;
+}
+
+
+// prefill flops for n_new tokens appended after n_past cached ones (causal attention over everything so far)
+double prefillFlops(const ModelConfig& mc, double n_past, double n_new) {
+    double q_dim = (double)mc.num_attention_heads * mc.head_dim;
+    double attn = 4.0 * mc.num_hidden_layers * q_dim * (n_new * n_past + n_new * n_new / 2);
+    return 2.0 * mc.parameters * n_new + attn;
+}
+
+
+/*
+prefix caching savings
+
+    prefix <config> <params> <quant_format> <bpw|quant_size> <shared_prefix> <unique> <concurrency> <kv_cache_bit_size>
+        [--block-size <tokens>] [--gpu <name> | --vram <GiB>]
+
+the shared prefix is cached once in whole blocks (vllm apc uses 16 token blocks, llama.cpp slots reuse the
+exact prefix: --block-size 1), the partial last block and the unique part stay per request, at least one block each.
+without caching every request holds its whole prompt, also rounded up to blocks
+*/
+int prefixMain(vector<string> args) {
+    string vramFlag = takeFlag(args, "--vram");
+    string gpuName = takeFlag(args, "--gpu", "rtx4090");
+    auto gpu = gpu_profiles.find(gpuName);
+    if (gpu == gpu_profiles.end()) {
+        cerr << "Unknown gpu (" << gpuName << "). Exiting." << endl;
+        return 1;
+    }
+    int block = 16;
+    double vram = 0;
+    try {
+        block = max(stoi(takeFlag(args, "--block-size", "16")), 1);
+        vram = vramFlag.empty() ? gpu->second.vram_gib * GIB : stod(vramFlag) * GIB;
+    }
+    catch (exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+
+    if (args.size() != 8) {
+        cerr << "Usage: prefix <config> <params> <quant_format> <bpw|quant_size> <shared_prefix> <unique> <concurrency> <kv_cache_bit_size>"
+            << " [--block-size <tokens>] [--gpu <name> | --vram <GiB>]" << endl;
+        return 1;
+    }
+
+    try {
+        ModelConfig mc = loadModelConfig(args[0], stod(args[1]) * 1e9);
+        double weights = formatModelSize(mc, args[2], args[3]);
+        int prefix = stoi(args[4]);
+        int unique = stoi(args[5]);
+        int users = stoi(args[6]);
+        int cache_bit = stoi(args[7]);
+        if (prefix < 0 || unique < 0 || prefix + unique < 1 || users < 1) {
+            throw runtime_error("Need a non empty request (prefix + unique >= 1) and at least one user");
+        }
+
+        int request = prefix + unique;
+        int shared = prefix / block * block;
+        int private_tokens = request - shared;
+
+        // a paged cache allocates whole blocks, with or without sharing, and gives every request at least one
+        // block of its own, even when the prompt is all shared
+        auto blocks = [&](int tokens) { return max((tokens + block - 1) / block, 1) * block; };
+        double kv_request = kvCache(blocks(request), mc, cache_bit);
+        double kv_shared = kvCache(shared, mc, cache_bit);
+        double kv_private = kvCache(blocks(private_tokens), mc, cache_bit);
+        double buffers = ctxSize(request, mc, 512, cache_bit) - kvCache(request, mc, cache_bit);
+
+        double kv_duplicated = users * kv_request;
+        double kv_dedup = kv_shared + users * kv_private;
+
+        // how many users the budget holds either way
+        double free_bytes = vram - weights - buffers;
+        long long max_users = free_bytes > 0 ? (long long)(free_bytes / kv_request) : 0;
+        long long max_users_cached = free_bytes > kv_shared ? (long long)((free_bytes - kv_shared) / kv_private) : 0;
+
+        // everyone after the first skips the cached blocks
+        double flops_full = users * prefillFlops(mc, 0, request);
+        double flops_cached = prefillFlops(mc, 0, request) + (users - 1) * prefillFlops(mc, shared, private_tokens);
+        double flops_rate = gpu->second.fp16_tflops * 1e12 * GPU_FLOPS_EFF;
+
+        json out;
+        out["shared_tokens_cached"] = shared;
+        out["tokens_per_request"] = private_tokens;
+        out["kv_without_caching"] = kv_duplicated / GIB;
+        out["kv_with_caching"] = kv_dedup / GIB;
+        out["kv_saved"] = (kv_duplicated - kv_dedup) / GIB;
+        out["weights"] = weights / GIB;
+        out["total_without_caching"] = (weights + buffers + kv_duplicated) / GIB;
+        out["total_with_caching"] = (weights + buffers + kv_dedup) / GIB;
+        out["max_concurrency_without_caching"] = max_users;
+        out["max_concurrency_with_caching"] = max_users_cached;
+        out["prefill_tflop_without_caching"] = flops_full / 1e12;
+        out["prefill_tflop_with_caching"] = flops_cached / 1e12;
+        out["prefill_saved_fraction"] = flops_full > 0 ? 1 - flops_cached / flops_full : 0;
+        out["prefill_seconds_saved"] = (flops_full - flops_cached) / flops_rate;
+        cout << out.dump(2) << endl;
+    }
+    catch (exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
+
+
+/*
+kv cache tiering across gpu, host ram and disk
+
+    tier <config> <params> <quant_format> <bpw|quant_size> <ctx> <kv_cache_bit_size>
+        [--users <n>] [--hot <tokens>] [--host <GiB>] [--disk <GiB>] [--cold-read <0-1>]
+        [--gpu <name> | --vram <GiB>] [--nvme-bw <GB/s>]
+
+every sequence keeps its last --hot tokens on the gpu, the rest of its kv fills what's left of the gpu, then the host,
+then the disk. --cold-read is the share of cold kv a decode step still reads (1 = full attention, lower for
+top-k / retrieval attention). cold blocks are prefetched layer by layer, so transfers overlap with compute
+*/
+int tierMain(vector<string> args) {
+    int users = 1, hot = 4096;
+    double host = 0, disk = 0, cold_read = 1, nvme_bw = 7, vram = 0;
+    string gpuName;
+    try {
+        users = max(stoi(takeFlag(args, "--users", "1")), 1);
+        hot = max(stoi(takeFlag(args, "--hot", "4096")), 0);
+        host = stod(takeFlag(args, "--host", "0")) * GIB;
+        disk = stod(takeFlag(args, "--disk", "0")) * GIB;
+        cold_read = stod(takeFlag(args, "--cold-read", "1"));
+        nvme_bw = stod(takeFlag(args, "--nvme-bw", "7"));
+        string vramFlag = takeFlag(args, "--vram");
+        gpuName = takeFlag(args, "--gpu", "rtx4090");
+        if (!gpu_profiles.count(gpuName)) throw runtime_error("Unknown gpu: " + gpuName);
+        vram = vramFlag.empty() ? gpu_profiles.at(gpuName).vram_gib * GIB : stod(vramFlag) * GIB;
+    }
+    catch (exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+    if (cold_read < 0 || cold_read > 1) {
+        cerr << "Cold read share has to be between 0 and 1." << endl;
+        return 1;
+    }
+
+    if (args.size() != 6) {
+        cerr << "Usage: tier <config> <params> <quant_format> <bpw|quant_size> <ctx> <kv_cache_bit_size>"
+            << " [--users <n>] [--hot <tokens>] [--host <GiB>] [--disk <GiB>] [--cold-read <0-1>]"
+            << " [--gpu <name> | --vram <GiB>] [--nvme-bw <GB/s>]" << endl;
+        return 1;
+    }
+
+    try {
+        ModelConfig mc = loadModelConfig(args[0], stod(args[1]) * 1e9);
+        double weights = formatModelSize(mc, args[2], args[3]);
+        int context = stoi(args[4]);
+        int cache_bit = stoi(args[5]);
+        const GpuProfile& hw = gpu_profiles.at(gpuName);
+
+        double kv_total = users * kvCache(context, mc, cache_bit);
+        double kv_hot = users * kvCache(min(hot, context), mc, cache_bit);
+        double buffers = ctxSize(context, mc, 512, cache_bit) - kvCache(context, mc, cache_bit);
+
+        // fill the tiers in order
+        double gpu_free = vram - weights - buffers - kv_hot;
+        if (gpu_free < 0) {
+            cerr << "Weights and the hot window don't fit on the gpu (" << -gpu_free / GIB << " GiB short)." << endl;
+            return 1;
+        }
+        double cold = kv_total - kv_hot;
+        double on_gpu = min(cold, gpu_free);
+        double on_host = min(cold - on_gpu, host);
+        double on_disk = min(cold - on_gpu - on_host, disk);
+        double spilled = cold - on_gpu - on_host - on_disk;
+        if (spilled > 0) {
+            cerr << "The kv cache doesn't fit in the tiers (" << spilled / GIB << " GiB short)." << endl;
+            return 1;
+        }
+
+        // one decode step serves every user; disk blocks cross nvme and then pcie
+        double host_bytes = on_host * cold_read;
+        double disk_bytes = on_disk * cold_read;
+        double step_gpu = decodeStepTime(mc, weights, kv_hot + on_gpu * cold_read, context, users, hw);
+        double step_pcie = (host_bytes + disk_bytes) / (hw.pcie_gbs * 1e9);
+        double step_nvme = disk_bytes / (nvme_bw * 1e9);
+        double step = max({ step_gpu, step_pcie, step_nvme });
+
+        // the same step with everything resident on a big enough gpu
+        double step_resident = decodeStepTime(mc, weights, kv_hot + cold * cold_read, context, users, hw);
+
+        json out;
+        out["kv_total"] = kv_total / GIB;
+        out["kv_gpu"] = (kv_hot + on_gpu) / GIB;
+        out["kv_host"] = on_host / GIB;
+        out["kv_disk"] = on_disk / GIB;
+        out["gpu_used"] = (weights + buffers + kv_hot + on_gpu) / GIB;
+        out["vram_needed_without_tiering"] = (weights + buffers + kv_total) / GIB;
+        out["pcie_bytes_per_token"] = (host_bytes + disk_bytes) / users;
+        out["nvme_bytes_per_token"] = disk_bytes / users;
+        out["bottleneck"] = step == step_nvme && step_nvme > 0 ? "nvme" : step == step_pcie && step_pcie > 0 ? "pcie" : "gpu";
+        out["tokens_per_second"] = users / step;
+        out["tokens_per_second_resident"] = users / step_resident;
+        out["throughput_penalty"] = 1 - step_resident / step;
+        cout << out.dump(2) << endl;
+    }
+    catch (exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
+
+
+// work stealing pool: each worker pops its own deque from the back and steals from the front of the others.
+// tasks may submit more tasks, run() returns once nothing is queued or running
+class TaskPool {
+public:
+    explicit TaskPool(unsigned n_threads) : queues(max(n_threads, 1u)) {}
+
+    void submit(function<void()> task) {
+        size_t q = current >= 0 ? current : next++ % queues.size();
+        pending++;
+        {
+            lock_guard<mutex> lock(queues[q].lock);
+            queues[q].tasks.push_back(move(task));
+        }
+        queued++;
+        // taking the lock orders this against a worker checking queued before it sleeps
+        { lock_guard<mutex> lock(idle_lock); }
+        wake.notify_one();
+    }
+
+    void run() {
+        vector<thread> threads;
+        for (size_t i = 0; i < queues.size(); i++) {
+            threads.emplace_back([this, i] { work((int)i); });
+        }
+        for (auto& t : threads) t.join();
+    }
+
+private:
+    struct Queue {
+        mutex lock;
+        deque<function<void()>> tasks;
+    };
+
+    bool pop(int self, function<void()>& task) {
+        for (size_t i = 0; i < queues.size(); i++) {
+            Queue& q = queues[(self + i) % queues.size()];
+            lock_guard<mutex> lock(q.lock);
+            if (q.tasks.empty()) continue;
+            if (i == 0) {
+                task = move(q.tasks.back());
+                q.tasks.pop_back();
+            }
+            else {
+                task = move(q.tasks.front());
+                q.tasks.pop_front();
+            }
+            queued--;
+            return true;
+        }
+        return false;
+    }
+
+    // tasks catch their own exceptions, one escaping here ends the process
+    void work(int self) {
+        current = self;
+        function<void()> task;
+        while (true) {
+            if (pop(self, task)) {
+                task();
+                if (--pending == 0) {
+                    { lock_guard<mutex> lock(idle_lock); }
+                    wake.notify_all();
+                }
+                continue;
+            }
+            // sleep until something is queued or everything (including running tasks) is done
+            unique_lock<mutex> lock(idle_lock);
+            wake.wait(lock, [this] { return queued > 0 || pending == 0; });
+            if (pending == 0) break;
+        }
+        current = -1;
+    }
+
+    vector<Queue> queues;
+    atomic<size_t> pending{ 0 }, queued{ 0 }, next{ 0 };
+    mutex idle_lock;
+    condition_variable wake;
+    static thread_local int current;
+};
+
+thread_local int TaskPool::current = -1;
+
+
+struct GgufHeader {
+    json metadata;       // arrays of strings and long arrays are reduced to their length
+    double parameters{};
+    double data_offset{};
+};
+
+struct GgufTruncated {};
+
+// parses the gguf kv metadata and tensor infos out of the start of the file,
+// nullopt when data ends before the header does
+optional<GgufHeader> parseGgufHeader(string_view data, const string& path) {
+    size_t pos = 0;
+    auto take = [&](size_t n) {
+        if (data.size() - pos < n) throw GgufTruncated{};
+        const char* p = data.data() + pos;
+        pos += n;
+        return p;
+    };
+    auto read = [&](auto& value) {
+        memcpy(&value, take(sizeof(value)), sizeof(value));
+    };
+    auto readString = [&]() {
+        uint64_t n;
+        read(n);
+        if (n > (1u << 24)) throw runtime_error("Corrupt gguf string length: " + path);
+        return string(take(n), n);
+    };
+    function<json(uint32_t)> readValue = [&](uint32_t type) -> json {
+        switch (type) {
+        case 0: { uint8_t v; read(v); return v; }
+        case 1: { int8_t v; read(v); return v; }
+        case 2: { uint16_t v; read(v); return v; }
+        case 3: { int16_t v; read(v); return v; }
+        case 4: { uint32_t v; read(v); return v; }
+        case 5: { int32_t v; read(v); return v; }
+        case 6: { float v; read(v); return v; }
+        case 7: { uint8_t v; read(v); return v != 0; }
+        case 8: return readString();
+        case 10: { uint64_t v; read(v); return v; }
+        case 11: { int64_t v; read(v); return v; }
+        case 12: { double v; read(v); return v; }
+        case 9: {
+            uint32_t element;
+            uint64_t n;
+            read(element);
+            read(n);
+            // per layer hyperparameters are short numeric arrays, vocab and merges are only counted
+            bool keep = element != 8 && element != 9 && n <= 4096;
+            json values = json::array();
+            for (uint64_t i = 0; i < n; i++) {
+                json v = readValue(element);
+                if (keep) values.push_back(v);
+            }
+            return keep ? values : json(n);
+        }
+        default:
+            throw runtime_error("Unknown gguf value type " + to_string(type) + ": " + path);
+        }
+    };
+
+    try {
+        uint32_t magic, version;
+        read(magic);
+        read(version);
+        if (magic != 0x46554747) {
+            throw runtime_error("Not a gguf file: " + path);
+        }
+        if (version < 2) {
+            throw runtime_error("Unsupported gguf version " + to_string(version) + ": " + path);
+        }
+
+        uint64_t n_tensors, n_kv;
+        read(n_tensors);
+        read(n_kv);
+
+        GgufHeader header;
+        for (uint64_t i = 0; i < n_kv; i++) {
+            string key = readString();
+            uint32_t type;
+            read(type);
+            header.metadata[key.c_str()] = readValue(type);
+        }
+
+        for (uint64_t i = 0; i < n_tensors; i++) {
+            readString();
+            uint32_t n_dims, type;
+            read(n_dims);
+            double elements = 1;
+            for (uint32_t d = 0; d < n_dims; d++) {
+                uint64_t ne;
+                read(ne);
+                elements *= ne;
+            }
+            uint64_t offset;
+            read(type);
+            read(offset);
+            header.parameters += elements;
+        }
+
+        double alignment = header.metadata.value("general.alignment", 32);
+        header.data_offset = ceil(pos / alignment) * alignment;
+        return header;
+    }
+    catch (GgufTruncated&) {
+        return nullopt;
+    }
+}
+
+
+// the first `limit` bytes of a file, 0 = all of it
+string readFilePrefix(const string& path, uintmax_t limit = 0) {
+    ifstream file(path, ios::binary | ios::ate);
+    if (!file.is_open()) {
+        throw runtime_error("Failed to open file: " + path);
+    }
+    uintmax_t size = file.tellg();
+    string data(limit > 0 ? min(size, limit) : size, '\0');
+    file.seekg(0);
+    file.read(data.data(), data.size());
+    data.resize(file.gcount());
+    return data;
+}
+
+
+// headers with big vocabularies run to a few MiB, so start there and widen the window if needed
+constexpr uintmax_t GGUF_HEADER_PREFIX = 8 << 20;
+
+GgufHeader readGgufHeader(const string& path, string data = "") {
+    for (uintmax_t limit = GGUF_HEADER_PREFIX;; limit *= 8) {
+        if (data.empty()) data = readFilePrefix(path, limit);
+        if (auto header = parseGgufHeader(data, path)) return *header;
+        if (data.size() < limit) throw runtime_error("Truncated gguf header: " + path);
+        data.clear();
+    }
+}
+
+
+// one file for ingestFiles: the whole file, or its first `limit` bytes
+struct FileRead {
+    string path;
+    uintmax_t size{};   // from the directory listing
+    uintmax_t limit{};
+    function<void(string data, string error)> done;  // runs on a pool worker
+};
+
+// reads every file and hands it to its callback on the pool as soon as it is in memory, so parsing overlaps
+// with the reads still in flight. call it from a pool task. with liburing the opens, reads and closes of a batch
+// go through io_uring in one submission each, without it every file is a blocking read on a pool worker
+constexpr unsigned INGEST_BATCH = 64;
+
+void ingestFiles(vector<FileRead> reads, TaskPool& pool) {
+#ifdef HAVE_IO_URING
+    io_uring ring;
+    if (io_uring_queue_init(INGEST_BATCH, &ring, 0) == 0) {
+        // kept out here so an abandoned batch's buffers outlive the ring
+        vector<int> fds;
+        vector<string> buffers, errors;
+        vector<bool> sent;
+        vector<FileRead> fallback;
+
+        // waits for n completions, user data is the index in the batch. false when the ring itself fails
+        auto reap = [&](size_t n, auto&& each) {
+            for (size_t k = 0; k < n; k++) {
+                io_uring_cqe* cqe;
+                int err;
+                while ((err = io_uring_wait_cqe(&ring, &cqe)) == -EINTR) {}
+                if (err < 0) return false;
+                each((size_t)(uintptr_t)io_uring_cqe_get_data(cqe), cqe->res);
+                io_uring_cqe_seen(&ring, cqe);
+            }
+            return true;
+        };
+
+        for (size_t begin = 0; begin < reads.size(); begin += INGEST_BATCH) {
+            size_t n = min<size_t>(INGEST_BATCH, reads.size() - begin);
+            fds.assign(n, -1);
+            buffers.assign(n, string());
+            errors.assign(n, string());
+            sent.assign(n, false);
+
+            for (size_t i = 0; i < n; i++) {
+                io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+                io_uring_prep_openat(sqe, AT_FDCWD, reads[begin + i].path.c_str(), O_RDONLY | O_CLOEXEC, 0);
+                io_uring_sqe_set_data(sqe, (void*)(uintptr_t)i);
+            }
+            io_uring_submit(&ring);
+            bool ok = reap(n, [&](size_t i, int res) {
+                if (res < 0) errors[i] = "Failed to open file: " + reads[begin + i].path + " (" + strerror(-res) + ")";
+                else fds[i] = res;
+            });
+
+            if (ok) {
+                size_t queued = 0;
+                for (size_t i = 0; i < n; i++) {
+                    if (fds[i] < 0) continue;
+                    FileRead& r = reads[begin + i];
+                    buffers[i].resize(r.limit > 0 ? min(r.size, r.limit) : r.size);
+                    io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+                    io_uring_prep_read(sqe, fds[i], buffers[i].data(), buffers[i].size(), 0);
+                    io_uring_sqe_set_data(sqe, (void*)(uintptr_t)i);
+                    queued++;
+                }
+                io_uring_submit(&ring);
+                ok = reap(queued, [&](size_t i, int res) {
+                    if (res < 0) {
+                        errors[i] = "Failed to read file: " + reads[begin + i].path + " (" + strerror(-res) + ")";
+                        return;
+                    }
+                    // network filesystems may return short reads, finish those synchronously
+                    for (size_t got = res; got < buffers[i].size();) {
+                        ssize_t more = pread(fds[i], buffers[i].data() + got, buffers[i].size() - got, got);
+                        if (more <= 0) {
+                            buffers[i].resize(got);
+                            break;
+                        }
+                        got += more;
+                    }
+                    FileRead& r = reads[begin + i];
+                    pool.submit([done = move(r.done), data = move(buffers[i])]() mutable { done(move(data), ""); });
+                    sent[i] = true;
+                });
+            }
+
+            if (!ok) {
+                // the ring is unusable: close what the batch opened and read everything not handed over yet the
+                // blocking way, a file whose completion was lost is simply read again
+                for (size_t i = 0; i < n; i++) {
+                    if (fds[i] >= 0) close(fds[i]);
+                    if (!sent[i]) fallback.push_back(move(reads[begin + i]));
+                }
+                for (size_t i = begin + n; i < reads.size(); i++) fallback.push_back(move(reads[i]));
+                break;
+            }
+
+            size_t queued = 0;
+            for (size_t i = 0; i < n; i++) {
+                if (fds[i] >= 0) {
+                    io_uring_prep_close(io_uring_get_sqe(&ring), fds[i]);
+                    queued++;
+                }
+                if (!errors[i].empty()) {
+                    pool.submit([done = move(reads[begin + i].done), error = errors[i]] { done("", error); });
+                }
+            }
+            io_uring_submit(&ring);
+            // every callback of the batch is out, a failure here only leaves the ring behind
+            if (!reap(queued, [](size_t, int) {})) {
+                for (size_t i = begin + n; i < reads.size(); i++) fallback.push_back(move(reads[i]));
+                break;
+            }
+        }
+        io_uring_queue_exit(&ring);
+        if (fallback.empty()) return;
+        reads = move(fallback);
+    }
+#endif
+    for (auto& r : reads) {
+        pool.submit([r = move(r)] {
+            string data;
+            try {
+                data = readFilePrefix(r.path, r.limit);
+            }
+            catch (exception& e) {
+                r.done("", e.what());
+                return;
+            }
+            r.done(move(data), "");
+        });
+    }
+}
+
+
+// the llama.cpp hyperparameters a kv cache estimate needs, per layer arrays count their largest entry
+ModelConfig ggufModelConfig(const GgufHeader& header) {
+    const json& meta = header.metadata;
+    string arch = meta.value("general.architecture", string());
+    if (arch.empty()) {
+        throw runtime_error("gguf has no general.architecture");
+    }
+    auto get = [&](const string& key, int fallback) {
+        auto it = meta.find((arch + "." + key).c_str());
+        if (it == meta.end()) return fallback;
+        if (it->is_array()) return it->empty() ? fallback : it->at(distance(it->begin(), max_element(it->begin(), it->end()))).get<int>();
+        return it->get<int>();
+    };
+
+    ModelConfig mc;
+    mc.model_type = arch;
+    mc.hidden_size = get("embedding_length", 0);
+    mc.num_hidden_layers = get("block_count", 0);
+    mc.num_attention_heads = get("attention.head_count", 0);
+    mc.num_key_value_heads = get("attention.head_count_kv", mc.num_attention_heads);
+    mc.intermediate_size = get("feed_forward_length", 0);
+    mc.num_experts = get("expert_count", 0);
+    mc.expert_intermediate_size = get("expert_feed_forward_length", 0);
+    mc.head_dim = get("attention.key_length", mc.num_attention_heads > 0 ? mc.hidden_size / mc.num_attention_heads : 0);
+    auto tokens = meta.find("tokenizer.ggml.tokens");
+    mc.vocab_size = get("vocab_size", tokens != meta.end() && tokens->is_number() ? tokens->get<int>() : 0);
+    mc.torch_dtype = "float16";
+    mc.parameters = header.parameters;
+    if (mc.hidden_size <= 0 || mc.num_hidden_layers <= 0 || mc.num_attention_heads <= 0) {
+        throw runtime_error("gguf is missing " + arch + " hyperparameters");
+    }
+    return mc;
+}
+
+
+struct ScanEntry {
+    string name;
+    string path;
+    string format;
+    string revision;
+    double weights{};
+    string error;
+};
+
+// "models--org--name/snapshots/<rev>" is the hub cache layout, anything else is named after its directory
+void scanName(const filesystem::path& dir, const filesystem::path& root, ScanEntry& entry) {
+    for (auto it = dir.begin(); it != dir.end(); ++it) {
+        string part = it->string();
+        if (part.rfind("models--", 0) != 0) continue;
+        entry.name = part.substr(8);
+        for (size_t pos; (pos = entry.name.find("--")) != string::npos;) entry.name.replace(pos, 2, "/");
+        if (++it != dir.end() && it->string() == "snapshots" && ++it != dir.end()) entry.revision = it->string();
+        return;
+    }
+    error_code ec;
+    entry.name = filesystem::relative(dir, root, ec).generic_string();
+    if (entry.name.empty() || entry.name == ".") entry.name = dir.filename().string();
+}
+
+// how scanLibrary reports back, both are called from pool threads. identity hashes what identifies a model:
+// the files read for a safetensors checkpoint, path, size and mtime for a gguf
+struct ScanHooks {
+    // before a model is read (ggufs) or parsed (safetensors), true skips it
+    function<bool(ScanEntry&, const KeyHasher& identity)> skip{};
+    // mc is null when the model couldn't be sized, entry.error says why
+    function<void(ScanEntry, const ModelConfig*, const KeyHasher& identity)> found{};
+};
+
+// every directory with a config.json is a safetensors model (sized from model.safetensors.index.json or the
+// .safetensors files next to it), every .gguf is a model of its own (split ggufs are counted once, mmproj files skipped)
+void scanLibrary(const filesystem::path& root, unsigned n_threads, const ScanHooks& hooks) {
+    TaskPool pool(n_threads);
+
+    // the walk only lists directories, every file read is queued for ingestFiles
+    mutex reads_lock;
+    vector<FileRead> reads;
+    auto queueRead = [&](FileRead r) {
+        lock_guard<mutex> lock(reads_lock);
+        reads.push_back(move(r));
+    };
+
+    // config.json and the safetensors index arrive separately, the last one to land sizes the model
+    // each read has its own error slot, the last one to land merges them
+    struct SafetensorsJob {
+        ScanEntry entry;
+        string config, index;
+        string config_error, index_error;
+        atomic<int> waiting{ 0 };
+    };
+    auto sizeSafetensors = [&](SafetensorsJob& job) {
+        ScanEntry& entry = job.entry;
+        if (entry.error.empty()) entry.error = !job.config_error.empty() ? job.config_error : job.index_error;
+        KeyHasher identity;
+        identity.add("scan-safetensors").add(job.config).add(job.index).add(entry.weights);
+        try {
+            if (!entry.error.empty()) throw runtime_error(entry.error);
+            if (hooks.skip && hooks.skip(entry, identity)) return;
+            if (!job.index.empty()) {
+                entry.weights = json::parse(job.index).at("metadata").at("total_size").get<double>();
+            }
+            if (job.config.empty()) {
+                entry.error = "no config.json, kv cache not estimated";
+                hooks.found(move(entry), nullptr, identity);
+                return;
+            }
+
+            ModelConfig mc = parseConfig(parseConfigJson(job.config.data(), job.config.data() + job.config.size()), 0);
+            if (mc.parameters <= 0) mc.parameters = tensorParams(tensorList(mc));
+            if (entry.weights <= 0) {
+                // config only snapshot, size the checkpoint it describes
+                if (mc.parameters <= 0) throw runtime_error("no weights and the config doesn't describe every tensor");
+                entry.weights = formatModelSize(mc, "native", "0");
+            }
+            hooks.found(move(entry), &mc, identity);
+        }
+        catch (exception& e) {
+            entry.error = e.what();
+            hooks.found(move(entry), nullptr, identity);
+        }
+    };
+
+    auto queueSafetensors = [&](const filesystem::path& dir, uintmax_t config_size, uintmax_t index_size, double shard_bytes) {
+        auto job = make_shared<SafetensorsJob>();
+        scanName(dir, root, job->entry);
+        job->entry.path = dir.string();
+        job->entry.format = "safetensors";
+        job->entry.weights = shard_bytes;
+        job->waiting = (config_size > 0) + (index_size > 0);
+        auto arrived = [&sizeSafetensors, job](string* slot, string* error_slot) {
+            return [&sizeSafetensors, job, slot, error_slot](string data, string error) {
+                *slot = move(data);
+                *error_slot = move(error);
+                if (--job->waiting == 0) sizeSafetensors(*job);
+            };
+        };
+        if (config_size > 0) {
+            queueRead({ (dir / "config.json").string(), config_size, 0, arrived(&job->config, &job->config_error) });
+        }
+        if (index_size > 0) {
+            queueRead({ (dir / "model.safetensors.index.json").string(), index_size, 0, arrived(&job->index, &job->index_error) });
+        }
+        if (job->waiting == 0) sizeSafetensors(*job);
+    };
+
+    auto queueGguf = [&](const filesystem::path& path, uintmax_t size, double split_bytes) {
+        ScanEntry entry;
+        scanName(path.parent_path(), root, entry);
+        string stem = path.stem().string();
+        entry.name += (entry.name.empty() ? "" : "/") + stem;
+        size_t at = entry.name.rfind("-00001-of-");
+        if (at != string::npos) entry.name.resize(at);
+        entry.path = path.string();
+        entry.format = "gguf";
+
+        error_code ec;
+        KeyHasher identity;
+        identity.add("scan-gguf").add(entry.path).add((double)size).add(split_bytes)
+            .add((double)filesystem::last_write_time(path, ec).time_since_epoch().count());
+        if (hooks.skip && hooks.skip(entry, identity)) return;
+
+        queueRead({ path.string(), size, GGUF_HEADER_PREFIX, [&hooks, entry, size, split_bytes, identity](string data, string error) mutable {
+            try {
+                if (!error.empty()) throw runtime_error(error);
+                GgufHeader header = readGgufHeader(entry.path, move(data));
+                // the first split carries the metadata, the others only add tensor data
+                entry.weights = size - header.data_offset + split_bytes;
+                ModelConfig mc = ggufModelConfig(header);
+                hooks.found(move(entry), &mc, identity);
+            }
+            catch (exception& e) {
+                entry.error = e.what();
+                hooks.found(move(entry), nullptr, identity);
+            }
+        } });
+    };
+
+    // directories are tasks too, so a wide store is walked in parallel
+    function<void(filesystem::path)> scanDir;
+    // a directory that can't be listed shows up as an error entry instead of ending the scan
+    auto walkFailed = [&](const filesystem::path& dir, const string& error) {
+        ScanEntry entry;
+        entry.name = dir.filename().string();
+        entry.path = dir.string();
+        entry.error = error;
+        KeyHasher identity;
+        identity.add("scan-dir").add(entry.path);
+        hooks.found(move(entry), nullptr, identity);
+    };
+    auto listDir = [&](const filesystem::path& dir) {
+        error_code ec;
+        uintmax_t config_size = 0, index_size = 0;
+        double shard_bytes = 0;
+        bool has_shards = false;
+        map<string, uintmax_t> ggufs;
+        filesystem::directory_iterator it(dir, ec), end;
+        for (; !ec && it != end; it.increment(ec)) {
+            const filesystem::directory_entry& entry = *it;
+            string name = entry.path().filename().string();
+            if (entry.is_directory(ec)) {
+                // blobs holds the same files as snapshots under content hashes
+                if (!entry.is_symlink(ec) && name != "blobs" && name[0] != '.') {
+                    pool.submit([&scanDir, p = entry.path()] { scanDir(p); });
+                }
+                continue;
+            }
+            string ext = entry.path().extension().string();
+            if (name == "config.json") config_size = entry.file_size(ec);
+            else if (name == "model.safetensors.index.json") index_size = entry.file_size(ec);
+            else if (ext == ".safetensors") {
+                shard_bytes += entry.file_size(ec);
+                has_shards = true;
+            }
+            else if (ext == ".gguf" && name.rfind("mmproj", 0) != 0) ggufs[name] = entry.file_size(ec);
+        }
+        if (ec) walkFailed(dir, "Failed to list directory: " + dir.string() + " (" + ec.message() + ")");
+        if (config_size > 0 || index_size > 0 || has_shards) {
+            queueSafetensors(dir, config_size, index_size, index_size > 0 ? 0 : shard_bytes);
+        }
+
+        for (auto& [name, size] : ggufs) {
+            // later splits are folded into the first
+            size_t of = name.rfind("-of-");
+            if (of == string::npos || of < 6) {
+                queueGguf(dir / name, size, 0);
+                continue;
+            }
+            if (name.compare(of - 6, 6, "-00001") != 0) continue;
+            double split_bytes = 0;
+            for (auto& [other, other_size] : ggufs) {
+                if (other != name && other.compare(0, of - 6, name, 0, of - 6) == 0 && other.find("-of-", of - 6) != string::npos) {
+                    split_bytes += other_size;
+                }
+            }
+            queueGguf(dir / name, size, split_bytes);
+        }
+    };
+    scanDir = [&](filesystem::path dir) {
+        try {
+            listDir(dir);
+        }
+        catch (exception& e) {
+            walkFailed(dir, e.what());
+        }
+    };
+
+    pool.submit([&scanDir, root] { scanDir(root); });
+    pool.run();
+
+    // the ingest task keeps the pool alive while the parse tasks it spawns overlap with its next batch
+    pool.submit([&] { ingestFiles(move(reads), pool); });
+    pool.run();
+}
+
+
+// --threads, every core by default
+unsigned takeThreads(vector<string>& args) {
+    int threads = stoi(takeFlag(args, "--threads", to_string(max(thread::hardware_concurrency(), 1u))));
+    if (threads < 1) throw runtime_error("--threads has to be at least 1");
+    return threads;
+}
+
+
+/*
+model library scan
+
+    scan <dir> [--ctx <n>] [--kv <kv_cache_bit_size>] [--gpus <name,name,...>] [--threads <n>]
+
+sizes everything scanLibrary finds at one context and reports which gpus each model fits on
+*/
+int scanMain(vector<string> args) {
+    int context = 8192, cache_bit = 16;
+    unsigned n_threads = 1;
+    vector<string> gpus;
+    try {
+        context = stoi(takeFlag(args, "--ctx", "8192"));
+        cache_bit = stoi(takeFlag(args, "--kv", "16"));
+        n_threads = takeThreads(args);
+        stringstream list(takeFlag(args, "--gpus"));
+        for (string gpu; getline(list, gpu, ',');) {
+            if (!gpu_profiles.count(gpu)) throw runtime_error("Unknown gpu: " + gpu);
+            gpus.push_back(gpu);
+        }
+    }
+    catch (exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+    if (gpus.empty()) {
+        for (auto& gpu : gpu_profiles) gpus.push_back(gpu.first);
+    }
+
+    if (args.size() != 1) {
+        cerr << "Usage: scan <dir> [--ctx <n>] [--kv <kv_cache_bit_size>] [--gpus <name,name,...>] [--threads <n>]" << endl;
+        return 1;
+    }
+    filesystem::path root = args[0];
+    if (!filesystem::is_directory(root)) {
+        cerr << "Not a directory: " << root.string() << endl;
+        return 1;
+    }
+
+    mutex results_lock;
+    vector<pair<ScanEntry, double>> results;  // entry and its total size
+    auto record = [&](ScanEntry entry, double total) {
+        lock_guard<mutex> lock(results_lock);
+        results.emplace_back(move(entry), total);
+    };
+
+    // with --cache a model's identity plus the options is the key
+    auto key = [&](KeyHasher identity) {
+        return cacheKey(identity.add(context).add(cache_bit));
+    };
+
+    ScanHooks hooks;
+    hooks.skip = [&](ScanEntry& entry, const KeyHasher& identity) {
+        double v[EstimateCache::VALUES];
+        if (estimate_cache == nullptr || !estimate_cache->lookup(key(identity), v)) return false;
+        entry.weights = v[0];
+        record(move(entry), v[1]);
+        return true;
+    };
+    hooks.found = [&](ScanEntry entry, const ModelConfig* mc, const KeyHasher& identity) {
+        double total = entry.weights;
+        if (mc != nullptr && entry.error.empty()) {
+            total += ctxSize(context, *mc, 512, cache_bit);
+            if (estimate_cache != nullptr) {
+                double v[EstimateCache::VALUES] = { entry.weights, total };
+                estimate_cache->insert(key(identity), v);
+            }
+        }
+        record(move(entry), total);
+    };
+    scanLibrary(root, n_threads, hooks);
+
+    sort(results.begin(), results.end(), [](auto& a, auto& b) { return a.first.path < b.first.path; });
+
+    json out;
+    out["ctx"] = context;
+    out["kv_cache_bit"] = cache_bit;
+    out["models"] = json::array();
+    out["errors"] = json::array();
+    for (auto& gpu : gpus) out["fits"][gpu.c_str()] = json::array();
+    for (auto& [entry, total] : results) {
+        if (!entry.error.empty() && entry.weights <= 0) {
+            out["errors"].push_back({ {"path", entry.path}, {"error", entry.error} });
+            continue;
+        }
+        json model;
+        model["name"] = entry.name;
+        model["path"] = entry.path;
+        model["format"] = entry.format;
+        if (!entry.revision.empty()) model["revision"] = entry.revision;
+        model["weights"] = entry.weights / GIB;
+        model["total_size"] = total / GIB;
+        if (!entry.error.empty()) model["note"] = entry.error;
+        model["fits"] = json::array();
+        for (auto& gpu : gpus) {
+            if (total <= gpu_profiles.at(gpu).vram_gib * GIB) {
+                model["fits"].push_back(gpu);
+                out["fits"][gpu.c_str()].push_back(entry.name);
+            }
+        }
+        out["models"].push_back(model);
+    }
+    cout << out.dump(2) << endl;
+    return 0;
+}
+
+
+void writeCatalog(const string& path, vector<pair<ScanEntry, ModelConfig>>& models) {
+    sort(models.begin(), models.end(), [](auto& a, auto& b) {
+        return tie(a.first.name, a.first.revision) < tie(b.first.name, b.first.revision);
+    });
+    size_t n = models.size();
+
+    vector<int32_t> ints(CATALOG_INTS * n);
+    vector<double> doubles(CATALOG_DOUBLES * n);
+    vector<uint32_t> refs(CATALOG_STRINGS * n);
+    string strings;
+    map<string, uint32_t> interned;  // model types and dtypes repeat a lot
+    auto intern = [&](const string& s) {
+        auto it = interned.find(s);
+        if (it != interned.end()) return it->second;
+        uint32_t offset = (uint32_t)strings.size();
+        strings.append(s).push_back('\0');
+        interned.emplace(s, offset);
+        return offset;
+    };
+
+    for (size_t i = 0; i < n; i++) {
+        const ScanEntry& entry = models[i].first;
+        const ModelConfig& mc = models[i].second;
+        int column = 0;
+#define CATALOG_WRITE_INT(field) ints[column++ * n + i] = (int32_t)mc.field;
+        CATALOG_INT_COLUMNS(CATALOG_WRITE_INT)
+#undef CATALOG_WRITE_INT
+        doubles[i] = entry.weights;
+        column = 1;
+#define CATALOG_WRITE_DOUBLE(field) doubles[column++ * n + i] = mc.field;
+        CATALOG_DOUBLE_COLUMNS(CATALOG_WRITE_DOUBLE)
+#undef CATALOG_WRITE_DOUBLE
+        column = 0;
+        for (const string* s : { &entry.name, &entry.revision, &entry.path, &entry.format }) refs[column++ * n + i] = intern(*s);
+#define CATALOG_WRITE_STRING(field) refs[column++ * n + i] = intern(mc.field);
+        CATALOG_STRING_COLUMNS(CATALOG_WRITE_STRING)
+#undef CATALOG_WRITE_STRING
+    }
+
+    auto align = [](uint64_t offset) { return (offset + 7) & ~uint64_t(7); };
+    CatalogHeader header{};
+    memcpy(header.magic, "LLMCATLG", 8);
+    header.version = CATALOG_VERSION;
+    header.count = (uint32_t)n;
+    header.n_ints = CATALOG_INTS;
+    header.n_doubles = CATALOG_DOUBLES;
+    header.n_strings = CATALOG_STRINGS;
+    header.ints_offset = align(sizeof(header));
+    header.doubles_offset = align(header.ints_offset + ints.size() * sizeof(int32_t));
+    header.refs_offset = align(header.doubles_offset + doubles.size() * sizeof(double));
+    header.strings_offset = align(header.refs_offset + refs.size() * sizeof(uint32_t));
+    header.strings_size = strings.size();
+
+    // written next to the target and renamed over it, so readers never map half a catalog
+    string temp = path + ".tmp";
+    {
+        ofstream out(temp, ios::binary | ios::trunc);
+        if (!out.is_open()) {
+            throw runtime_error("Failed to write catalog: " + temp);
+        }
+        auto put = [&](uint64_t offset, const void* data, size_t bytes) {
+            while ((uint64_t)out.tellp() < offset) out.put('\0');
+            out.write(static_cast<const char*>(data), bytes);
+        };
+        put(0, &header, sizeof(header));
+        put(header.ints_offset, ints.data(), ints.size() * sizeof(int32_t));
+        put(header.doubles_offset, doubles.data(), doubles.size() * sizeof(double));
+        put(header.refs_offset, refs.data(), refs.size() * sizeof(uint32_t));
+        put(header.strings_offset, strings.data(), strings.size());
+        if (!out) {
+            throw runtime_error("Failed to write catalog: " + temp);
+        }
+    }
+    error_code ec;
+    filesystem::rename(temp, path, ec);
+    if (ec) {
+        throw runtime_error("Failed to replace catalog: " + path + " (" + ec.message() + ")");
+    }
+}
+
+
+/*
+binary model catalog
+
+    catalog build <dir> <out> [--threads <n>]
+    catalog list <file>
+
+build compiles every config, gguf header and safetensors index under dir (found like scan does) into one file.
+with --catalog <file> any config argument that names a cataloged model ("org/name" or "org/name@revision")
+is read from the mapped catalog instead of parsed
+*/
+int catalogMain(vector<string> args) {
+    unsigned n_threads = 1;
+    try {
+        n_threads = takeThreads(args);
+    }
+    catch (exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+
+    if (args.size() == 3 && args[0] == "build") {
+        if (!filesystem::is_directory(args[1])) {
+            cerr << "Not a directory: " << args[1] << endl;
+            return 1;
+        }
+        mutex lock;
+        vector<pair<ScanEntry, ModelConfig>> models;
+        size_t skipped = 0;
+        ScanHooks hooks;
+        hooks.found = [&](ScanEntry entry, const ModelConfig* mc, const KeyHasher&) {
+            lock_guard<mutex> guard(lock);
+            if (mc == nullptr) {
+                cerr << "Skipping " << entry.path << ": " << entry.error << endl;
+                skipped++;
+                return;
+            }
+            models.emplace_back(move(entry), *mc);
+        };
+        scanLibrary(args[1], n_threads, hooks);
+
+        try {
+            writeCatalog(args[2], models);
+        }
+        catch (exception& e) {
+            cerr << e.what() << endl;
+            return 1;
+        }
+        json out;
+        out["catalog"] = args[2];
+        out["models"] = models.size();
+        out["skipped"] = skipped;
+        cout << out.dump(2) << endl;
+        return 0;
+    }
+
+    if (args.size() == 2 && args[0] == "list") {
+        try {
+            Catalog catalog(args[1]);
+            json out = json::array();
+            for (size_t i = 0; i < catalog.size(); i++) {
+                json model;
+                model["name"] = catalog.name(i);
+                if (!catalog.revision(i).empty()) model["revision"] = catalog.revision(i);
+                model["format"] = catalog.format(i);
+                model["path"] = catalog.path(i);
+                model["parameters"] = catalog.config(i).parameters;
+                model["weights"] = catalog.weights(i) / GIB;
+                out.push_back(model);
+            }
+            cout << out.dump(2) << endl;
+        }
+        catch (exception& e) {
+            cerr << e.what() << endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    cerr << "Usage: catalog build <dir> <out> [--threads <n>] | catalog list <file>" << endl;
+    return 1;
+}
+
+
+// struct-of-arrays index over model x gguf preset x llama.cpp cache type for budget queries. every model gets the
+// same number of rows, laid out model-major, so a query streams through contiguous columns one model at a time
+struct FitIndex {
+    static constexpr size_t N_QUANTS = size(gguf_quants);
+    size_t rows_per_model{};
+
+    // per model
+    vector<string> names;
+    vector<ModelConfig> configs;
+    // per row, weights is infinite for rows a model doesn't have (a gguf file only comes in its own quant)
+    vector<double> weights;
+    vector<double> kv_per_token;
+    vector<float> quality;  // bits per weight, then cache bits as the tie-breaker
+    vector<uint8_t> quant;  // into gguf_quants, N_QUANTS = the file's own
+    vector<uint8_t> kv_type;  // into llama_cache_types
 };
 
-struct ModelConfig {
-    int hidden_size{};
-    int num_attention_heads{};
-    int num_key_value_heads{};
-    int num_hidden_layers{};
-    std::string torch_dtype{};
-    double parameters{};
+FitIndex buildFitIndex(const Catalog& catalog) {
+    FitIndex index;
+    index.rows_per_model = (FitIndex::N_QUANTS + 1) * llama_cache_types.size();
+    for (size_t i = 0; i < catalog.size(); i++) {
+        ModelConfig mc = catalog.config(i);
+        if (mc.parameters <= 0) continue;
+        bool file = catalog.format(i) == "gguf";
+        string name(catalog.name(i));
+        if (!catalog.revision(i).empty()) name += "@" + string(catalog.revision(i));
 
-    double get_dtype_divider() const {
-        string digits_only;
-        for (char c : torch_dtype) {
-            if (isdigit(c)) {
-                digits_only.push_back(c);
+        for (size_t q = 0; q <= FitIndex::N_QUANTS; q++) {
+            // presets for checkpoints, the file itself for ggufs
+            bool present = file == (q == FitIndex::N_QUANTS);
+            double weights = !present ? INFINITY : file ? catalog.weights(i) : ggufModelSize(mc, gguf_quants[q]);
+            for (size_t k = 0; k < llama_cache_types.size(); k++) {
+                double cache_bits = llama_cache_types[k].second;
+                index.weights.push_back(weights);
+                index.kv_per_token.push_back(kvCache(1, mc, cache_bits));
+                index.quality.push_back((float)(weights * 8 / mc.parameters + cache_bits / 1000));
+                index.quant.push_back((uint8_t)q);
+                index.kv_type.push_back((uint8_t)k);
             }
         }
-        if (digits_only.empty())
-            throw runtime_error("Could not parse torch_dtype number");
-        double val = stod(digits_only) / 8.0;
-        return val;
+        index.names.push_back(move(name));
+        index.configs.push_back(move(mc));
     }
+    return index;
+}
+
+struct FitQuery {
+    double vram{};
+    int context = 8192;  // per user
+    int users = 1;
+    bool by_quality{};   // otherwise by predicted decode tokens/s
+    size_t limit = 50;
+    const GpuProfile* gpu{};
 };
 
-ModelConfig parseConfig(const json& j, double p) {
-    ModelConfig mc;
+struct FitResult {
+    size_t model;
+    size_t row;
+    double total;
+    double tps;
+};
 
-    if (j.contains("text_config")) {
-        // this shouldnt be here but just in case
-        return parseConfig(j["text_config"], p);
+// every row within the budget, best first
+vector<FitResult> queryFits(const FitIndex& index, const FitQuery& q) {
+    const size_t R = index.rows_per_model;
+    double tokens = (double)q.context * q.users;
+    double bandwidth = q.gpu->bandwidth_gbs * 1e9 * GPU_BW_EFF;
+    vector<double> total(R), tps(R);
+    vector<size_t> hits(R);
+    vector<FitResult> fits;
+
+    for (size_t m = 0; m < index.names.size(); m++) {
+        // buffers don't depend on the quant, so they're priced once per model
+        double buffers = ctxSize((int)min(tokens, 2e9), index.configs[m], 512, 0);
+        // one decode step for every user, slots sit half full on average. the compute side of the roofline is the
+        // same for every row of a model, only the bytes streamed differ
+        double compute_time = decodeStepTime(index.configs[m], 0, 0, q.context / 2.0, q.users, *q.gpu);
+        const double* w = &index.weights[m * R];
+        const double* kv = &index.kv_per_token[m * R];
+        for (size_t r = 0; r < R; r++) {
+            total[r] = w[r] + kv[r] * tokens + buffers;
+            tps[r] = q.users / max((w[r] + kv[r] * tokens / 2) / bandwidth, compute_time);
+        }
+        // compact the rows within budget without branching on them
+        size_t n = 0;
+        for (size_t r = 0; r < R; r++) {
+            hits[n] = r;
+            n += total[r] <= q.vram;
+        }
+        for (size_t i = 0; i < n; i++) {
+            fits.push_back({ m, m * R + hits[i], total[hits[i]], tps[hits[i]] });
+        }
     }
 
-    if (!j.contains("hidden_size") || !j.contains("num_attention_heads") || !j.contains("num_key_value_heads")
-        || !j.contains("num_hidden_layers") || !j.contains("torch_dtype")) {
-        throw runtime_error("Some required keys are missing in the config.json");
+    auto better = [&](const FitResult& a, const FitResult& b) {
+        if (q.by_quality && index.quality[a.row] != index.quality[b.row]) return index.quality[a.row] > index.quality[b.row];
+        return a.tps > b.tps;
+    };
+    size_t keep = min(q.limit, fits.size());
+    partial_sort(fits.begin(), fits.begin() + keep, fits.end(), better);
+    fits.resize(keep);
+    return fits;
+}
+
+json fitsJson(const FitIndex& index, const vector<FitResult>& fits) {
+    json out = json::array();
+    for (auto& f : fits) {
+        uint8_t q = index.quant[f.row];
+        json row;
+        row["model"] = index.names[f.model];
+        row["quant"] = q == FitIndex::N_QUANTS ? string("file") : string(gguf_quants[q].name);
+        row["kv_cache"] = llama_cache_types[index.kv_type[f.row]].first;
+        row["total_size"] = f.total / GIB;
+        row["tokens_per_second"] = f.tps;
+        out.push_back(row);
     }
+    return out;
+}
 
-    mc.hidden_size = j["hidden_size"].get<int>();
-    mc.num_attention_heads = j["num_attention_heads"].get<int>();
-    mc.num_key_value_heads = j["num_key_value_heads"].get<int>();
-    mc.num_hidden_layers = j["num_hidden_layers"].get<int>();
-    mc.torch_dtype = j["torch_dtype"].get<string>();
-    mc.parameters = p;
+// the index over --catalog, built on first use and kept for the process (serve answers many queries from it)
+const FitIndex& catalogFitIndex() {
+    if (active_catalog == nullptr) {
+        throw runtime_error("fits needs a model catalog, pass --catalog <file>");
+    }
+    static const FitIndex index = buildFitIndex(*active_catalog);
+    return index;
+}
 
-    return mc;
+
+/*
+what fits in a budget
+
+    fits [--gpu <name> | --vram <GiB>] [--ctx <n>] [--users <n>] [--sort tps|quality] [--limit <n>]
+
+searches every model of --catalog at every gguf preset and llama.cpp cache type (ggufs only at their own quant)
+for setups where --users sequences of --ctx tokens each fit, sorted by predicted decode tokens/s or by quality
+*/
+int fitsMain(vector<string> args) {
+    FitQuery q;
+    try {
+        q.gpu = &takeGpu(args, "rtx4090");
+        q.vram = takeVram(args, *q.gpu);
+        q.context = stoi(takeFlag(args, "--ctx", "8192"));
+        q.users = max(stoi(takeFlag(args, "--users", "1")), 1);
+        q.by_quality = takeFlag(args, "--sort", "tps") == "quality";
+        q.limit = stoul(takeFlag(args, "--limit", "50"));
+    }
+    catch (exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+    if (!args.empty()) {
+        cerr << "Usage: fits [--gpu <name> | --vram <GiB>] [--ctx <n>] [--users <n>] [--sort tps|quality] [--limit <n>]" << endl;
+        return 1;
+    }
+
+    try {
+        const FitIndex& index = catalogFitIndex();
+        cout << fitsJson(index, queryFits(index, q)).dump(2) << endl;
+    }
+    catch (exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+    return 0;
 }
 
 
-double inBuffer(int context, const ModelConfig& mc, int bsz) {
-    int inp_tokens = bsz;
-    int inp_embd = mc.hidden_size * bsz;
-    int inp_pos = bsz;
-    int inp_KQ_mask = context * bsz;
-    int inp_K_shift = context;
-    int inp_sum = bsz;
+/*
+json lines server
 
-    return inp_tokens + inp_embd + inp_pos + inp_KQ_mask + inp_K_shift + inp_sum;
+    serve
+
+reads one request per line from stdin and answers each on one line of stdout, a line holding an array is
+answered with an array. request keys (all but config/config_json optional):
+    {"id": any, "config": "path", "config_json": {...}, "params": 0, "format": "gguf", "quant": "Q4_K_M",
+     "ctx": 8192, "kv_bits": 16, "batch": 512, "all_logits": false, "images": 1, "image_size": 0}
+"op": "fits" runs a fits query against --catalog instead, see serveFits
+every document of a line lives in one arena that is rewound before the next line
+*/
+json serveEstimate(const json& request) {
+    double p = request.value("params", 0.0) * 1e9;
+    ModelConfig mc = request.contains("config_json")
+        ? configFromJson(request["config_json"], p, "config_json")
+        : loadModelConfig(request.at("config").get<string>(), p);
+
+    string format = request.value("format", string("gguf"));
+    transform(format.begin(), format.end(), format.begin(), ::tolower);
+    bool gguf = quant_formats.count(format) && quant_formats.at(format).gguf_table;
+    Estimate e = estimateMemory(mc, format, request.value("quant", string(gguf ? "Q4_K_M" : "0")), request.value("ctx", 8192),
+        request.value("batch", 512), request.value("kv_bits", 16), request.value("all_logits", false),
+        request.value("images", 1), request.value("image_size", 0));
+
+    json out;
+    if (request.contains("id")) out["id"] = request["id"];
+    out["model_size"] = e.model_size / GIB;
+    out["context_size"] = e.context_size / GIB;
+    out["runtime_overhead"] = e.overhead / GIB;
+    out["multimodal_size"] = e.multimodal / GIB;
+    out["image_tokens"] = e.image_tokens;
+    out["total_size"] = e.total() / GIB;
+    return out;
 }
 
+// "op": "fits" asks the catalog index, keys as the fits flags: vram (GiB) or gpu, ctx, users, sort, limit
+json serveFits(const json& request) {
+    FitQuery q;
+    string gpuName = request.value("gpu", string("rtx4090"));
+    if (!gpu_profiles.count(gpuName)) throw runtime_error("Unknown gpu: " + gpuName);
+    q.gpu = &gpu_profiles.at(gpuName);
+    q.vram = request.value("vram", q.gpu->vram_gib) * GIB;
+    q.context = request.value("ctx", 8192);
+    q.users = max(request.value("users", 1), 1);
+    q.by_quality = request.value("sort", "tps") == "quality";
+    q.limit = request.value("limit", 50);
 
-double computeBuffer(int context, const ModelConfig& mc, int bsz) {
-    if (bsz != 512) {
-        cerr << "Warning: batch size other than 512 is currently not supported for the compute buffer calculation" << endl;
-        bsz = 512; // forcibly set
+    const FitIndex& index = catalogFitIndex();
+    json out;
+    if (request.contains("id")) out["id"] = request["id"];
+    out["fits"] = fitsJson(index, queryFits(index, q));
+    return out;
+}
+
+json serveRequest(const json& request) {
+    try {
+        if (request.value("op", "estimate") == "fits") return serveFits(request);
+        return serveEstimate(request);
+    }
+    catch (exception& e) {
+        json out;
+        if (request.is_object() && request.contains("id")) out["id"] = request["id"];
+        out["error"] = e.what();
+        return out;
     }
-    return (context / 1024.0 * 2.0 + 0.75) * mc.num_attention_heads * 1024 * 1024;
 }
 
+int serveMain(vector<string> args) {
+    if (!args.empty()) {
+        cerr << "Usage: serve (requests on stdin, one json per line)" << endl;
+        return 1;
+    }
 
+    Arena arena;
+    string line;
+    while (getline(cin, line)) {
+        if (line.find_first_not_of(" \t\r") == string::npos) continue;
 
-double kvCache(int context, const ModelConfig& mc, int cache_bit) {
-    double n_gqa = (double)mc.num_attention_heads / mc.num_key_value_heads;
-    double n_embd_gqa = mc.hidden_size / n_gqa;
-    double n_elements = n_embd_gqa * (mc.num_hidden_layers * context);
-    double size = 2.0 * n_elements;
-    return size * (cache_bit / 8.0);
+        // nothing from the previous line is alive any more
+        arena.reset();
+        ArenaScope scope(arena);
+        json response;
+        try {
+            json request = json::parse(line);
+            if (request.is_array()) {
+                response = json::array();
+                for (auto& r : request) response.push_back(serveRequest(r));
+            }
+            else {
+                response = serveRequest(request);
+            }
+        }
+        catch (exception& e) {
+            response = json{ {"error", e.what()} };
+        }
+        cout << response.dump() << endl;
+    }
+    return 0;
 }
 
 
-double ctxSize(int context, const ModelConfig& mc, int bsz, int cache_bit) {
-    return inBuffer(context, mc, bsz) + kvCache(context, mc, cache_bit) + computeBuffer(context, mc, bsz);
+/*
+speculative decoding planner
+
+    spec <target_config> <target_params> <draft_config> <draft_params> <quant_size> <ctx> <kv_cache_bit_size>
+        [--draft-quant <quant_size>] [--acceptance <0-1>] [--gpu <name>] [--max-draft <n>]
+
+params in billions, 0 counts them from the config. both models are gguf and share the context size
+*/
+int specMain(vector<string> args) {
+    string draftQuant = takeFlag(args, "--draft-quant");
+    string gpuName = takeFlag(args, "--gpu", "rtx4090");
+    double acceptance = 0.7;
+    int maxDraft = 16;
+    try {
+        acceptance = stod(takeFlag(args, "--acceptance", "0.7"));
+        maxDraft = stoi(takeFlag(args, "--max-draft", "16"));
+    }
+    catch (exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+
+    if (args.size() != 7) {
+        cerr << "Usage: spec <target_config> <target_params> <draft_config> <draft_params> <quant_size> <ctx> <kv_cache_bit_size>"
+            << " [--draft-quant <quant_size>] [--acceptance <0-1>] [--gpu <name>] [--max-draft <n>]" << endl;
+        return 1;
+    }
+    if (acceptance <= 0 || acceptance >= 1) {
+        cerr << "Acceptance rate has to be between 0 and 1 (exclusive)." << endl;
+        return 1;
+    }
+    if (maxDraft < 1) {
+        cerr << "Max draft length has to be at least 1." << endl;
+        return 1;
+    }
+
+    const GgufQuant* targetQuant = findGgufQuant(args[4]);
+    const GgufQuant* draftQ = findGgufQuant(draftQuant.empty() ? args[4] : draftQuant);
+    if (targetQuant == nullptr || draftQ == nullptr) {
+        cerr << "Unknown gguf quant size. Exiting." << endl;
+        return 1;
+    }
+    auto gpu = gpu_profiles.find(gpuName);
+    if (gpu == gpu_profiles.end()) {
+        cerr << "Unknown gpu (" << gpuName << "). Exiting." << endl;
+        return 1;
+    }
+
+    int context = 0, cache_bit = 0;
+    ModelConfig target, draft;
+    try {
+        context = stoi(args[5]);
+        cache_bit = stoi(args[6]);
+        target = loadModelConfig(args[0], stod(args[1]) * 1e9);
+        draft = loadModelConfig(args[2], stod(args[3]) * 1e9);
+    }
+    catch (exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+    // llama.cpp tolerates a little padding difference between the two vocabs
+    if (abs(target.vocab_size - draft.vocab_size) > 128) {
+        cerr << "Warning: target and draft vocab sizes differ (" << target.vocab_size << " vs " << draft.vocab_size
+            << "), llama.cpp will refuse to pair them" << endl;
+    }
+
+    double target_weights = ggufModelSize(target, *targetQuant);
+    double draft_weights = ggufModelSize(draft, *draftQ);
+    double target_ctx = ctxSize(context, target, 512, cache_bit);
+    double draft_ctx = ctxSize(context, draft, 512, cache_bit);
+
+    // speedup over plain decoding for every draft length, keep the best
+    double target_kv = kvCache(context, target, cache_bit);
+    double t_base = decodeStepTime(target, target_weights, target_kv, context, 1, gpu->second);
+    double t_draft = decodeStepTime(draft, draft_weights, kvCache(context, draft, cache_bit), context, 1, gpu->second);
+    json by_len = json::array();
+    int best_len = 1;
+    double best_speedup = 0;
+    for (int n = 1; n <= maxDraft; n++) {
+        // expected tokens out of one draft+verify round with per token acceptance a
+        double expected = (1 - pow(acceptance, n + 1)) / (1 - acceptance);
+        double t_round = n * t_draft + decodeStepTime(target, target_weights, target_kv, context, n + 1, gpu->second);
+        double speedup = expected * t_base / t_round;
+        by_len.push_back({ {"draft_len", n}, {"expected_tokens", expected}, {"speedup", speedup} });
+        if (speedup > best_speedup) {
+            best_speedup = speedup;
+            best_len = n;
+        }
+    }
+
+    // the target scores best_len + 1 positions per round (logits only, no embeddings), the draft keeps its own
+    // logits. both context sizes already hold one output row
+    double verify_buf = (double)target.vocab_size * (best_len + 1) * 4
+        + (double)draft.vocab_size * best_len * 4 - outBuffer(target, 0, false) - outBuffer(draft, 0, false);
+    double total = target_weights + target_ctx + draft_weights + draft_ctx + verify_buf;
+    double plain_total = target_weights + target_ctx;
+
+    json out;
+    out["target_size"] = target_weights / GIB;
+    out["target_context_size"] = target_ctx / GIB;
+    out["draft_size"] = draft_weights / GIB;
+    out["draft_context_size"] = draft_ctx / GIB;
+    out["verify_buffer"] = verify_buf / GIB;
+    out["total_size"] = total / GIB;
+    out["extra_vram"] = (total - plain_total) / GIB;
+    out["gpu"] = gpuName;
+    out["fits"] = total <= gpu->second.vram_gib * GIB;
+    out["baseline_tokens_per_s"] = 1 / t_base;
+    out["best_draft_len"] = best_len;
+    out["speculative_tokens_per_s"] = best_speedup / t_base;
+    out["speedup"] = best_speedup;
+    out["by_draft_len"] = by_len;
+    cout << out.dump(2) << endl;
+    return 0;
 }
 
 
-double modelSize(const ModelConfig& mc, double bpw) {
-    return (mc.parameters * bpw) / 8.0;
+/*
+built-in models
+
+    models
+
+lists the names compiled in from models.def, any of them can stand in for a config.json path
+*/
+int modelsMain(vector<string> args) {
+    if (!args.empty()) {
+        cerr << "Usage: models" << endl;
+        return 1;
+    }
+
+    json out = json::array();
+    for (auto& m : builtin_models) {
+        ModelConfig mc = builtinConfig(m);
+        json row;
+        row["name"] = string(m.name);
+        row["model_type"] = mc.model_type;
+        row["parameters"] = mc.parameters / 1e9;
+        row["layers"] = mc.num_hidden_layers;
+        row["kv_heads"] = mc.num_key_value_heads;
+        row["experts"] = mc.num_experts;
+        out.push_back(row);
+    }
+    cout << out.dump(2) << endl;
+    return 0;
 }
 
 
@@ -134,12 +4620,40 @@ int main(int argc, char* argv[]) {
 	argv[0] = executable name
 	argv[1] = path to config.json
 	argv[2] = parameters in billions
-	argv[3] = quant format (gguf or exl2)
+	argv[3] = quant format (gguf, exl2, or anything in quant_formats)
 	argv[4] = ctx
 	argv[5] = kv cache bit size
 	argv[6] = batch size (if gguf)
-	argv[6] = bpw (if exl2) (exclusive)
+	argv[6] = bpw (if not gguf, 0 = format default) (exclusive)
 	argv[7] = quant size (if gguf) (exclusive)
+
+    short form, for built-in (see models) or cataloged names: <model> <quant> <ctx>
+    quant is a gguf preset (f16 cache, batch 512) or a quant format at its default bpw
+
+    optional flags (anywhere after the executable name)
+    --all-logits = keep logits for every prompt token (perplexity/embedding runs)
+    --formats <file> = extra/overriding quant formats (json, see loadQuantFormats)
+    --tensors = print the per tensor gguf type breakdown (human readable output only)
+    --images <n> = images encoded together by a multimodal model (default 1)
+    --image-size <px> = image resolution fed to the vision encoder (default: its native size)
+    --tp <n> / --pp <m> = tensor/pipeline parallel degree, adds the per rank split
+    --cache <file> = reuse estimates across runs (shared, memory mapped, created if missing)
+    --catalog <file> = resolve config arguments that name a cataloged model from the catalog
+    --coefficients [json|c|lua|python] = print the estimate's per term coefficients instead (default json)
+
+    subcommands (argv[1]), see the comment above each *Main function
+    spec = speculative decoding planner
+    lora = lora adapter size and how many fit next to the base model
+    train = fine-tuning memory per gpu (full, lora, qlora)
+    pack = place a list of models onto a gpu inventory
+    tune = search llama.cpp launch flags for the best predicted throughput
+    prefix = kv and prefill saved by caching a shared prompt prefix
+    tier = split the kv cache across gpu, host and disk and price the transfers
+    scan = size every model under a directory (hugging face cache, gguf) against the gpu profiles
+    serve = answer json lines estimate requests on stdin
+    catalog = compile a model library into a binary catalog for --catalog
+    fits = every cataloged model, quant and cache type that fits a budget, best first
+    models = list the built-in model configs
     */
 
     // these get actually set later
@@ -151,12 +4665,140 @@ int main(int argc, char* argv[]) {
     int cache_bit = 16;
     double bpw = 0;
     string quantSize{};
+    bool all_logits = false;
+    bool show_tensors = false;
+    int n_images = 1;
+    int image_size = 0;
+    int tp = 1;
+    int pp = 1;
+    string formatsPath{};
+    string cachePath{};
+    string catalogPath{};
+    string coefficients{};
+
+    // strip optional flags so the positional layout below stays the same
+    vector<char*> args;
+    for (int i = 0; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--all-logits") {
+            all_logits = true;
+        }
+        else if (arg == "--tensors") {
+            show_tensors = true;
+        }
+        else if (arg == "--images" && i + 1 < argc) {
+            n_images = atoi(argv[++i]);
+        }
+        else if (arg == "--image-size" && i + 1 < argc) {
+            image_size = atoi(argv[++i]);
+        }
+        else if (arg == "--tp" && i + 1 < argc) {
+            tp = max(atoi(argv[++i]), 1);
+        }
+        else if (arg == "--pp" && i + 1 < argc) {
+            pp = max(atoi(argv[++i]), 1);
+        }
+        else if (arg == "--formats" && i + 1 < argc) {
+            formatsPath = argv[++i];
+        }
+        else if (arg == "--cache" && i + 1 < argc) {
+            cachePath = argv[++i];
+        }
+        else if (arg == "--catalog" && i + 1 < argc) {
+            catalogPath = argv[++i];
+        }
+        else if (arg == "--coefficients") {
+            // the output style is optional, nothing positional is ever spelled like one
+            string next = i + 1 < argc ? argv[i + 1] : "";
+            bool styled = next == "json" || next == "c" || next == "lua" || next == "python";
+            coefficients = styled ? argv[++i] : "json";
+        }
+        else {
+            args.push_back(argv[i]);
+        }
+    }
+    argc = (int)args.size();
+    argv = args.data();
+
+    try {
+        // only an explicit file, so a run doesn't change with the directory it starts in
+        if (!formatsPath.empty()) {
+            loadQuantFormats(formatsPath);
+        }
+    }
+    catch (exception& e) {
+        cerr << "Failed to load quant formats: " << e.what() << endl;
+        return 1;
+    }
+
+    unique_ptr<EstimateCache> cache;
+    unique_ptr<Catalog> catalog;
+    try {
+        if (!cachePath.empty()) {
+            cache = make_unique<EstimateCache>(cachePath);
+            estimate_cache = cache.get();
+        }
+        if (!catalogPath.empty()) {
+            catalog = make_unique<Catalog>(catalogPath);
+            active_catalog = catalog.get();
+        }
+    }
+    catch (exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+
+    // subcommands take over the rest of the command line
+    if (argc > 1) {
+        string command = argv[1];
+        vector<string> rest(argv + 2, argv + argc);
+        if (command == "spec") return specMain(rest);
+        if (command == "lora") return loraMain(rest);
+        if (command == "train") return trainMain(rest);
+        if (command == "pack") return packMain(rest);
+        if (command == "tune") return tuneMain(rest);
+        if (command == "prefix") return prefixMain(rest);
+        if (command == "tier") return tierMain(rest);
+        if (command == "scan") return scanMain(rest);
+        if (command == "serve") return serveMain(rest);
+        if (command == "catalog") return catalogMain(rest);
+        if (command == "fits") return fitsMain(rest);
+        if (command == "models") return modelsMain(rest);
+    }
 
+    // short form: <model> <quant> <ctx>, only when the quant says so, so nothing else lands here by accident
+    string shortQuant = argc == 4 ? argv[2] : "";
+    transform(shortQuant.begin(), shortQuant.end(), shortQuant.begin(), ::tolower);
+    bool short_form = argc == 4 && (findGgufQuant(shortQuant) != nullptr || quant_formats.count(shortQuant) > 0);
+
+    if (short_form) {
+        configPath = argv[1];
+        try {
+            context = stoi(argv[3]);
+        }
+        catch (exception& e) {
+            cerr << "Invalid context size (" << argv[3] << "): " << e.what() << endl;
+            return 1;
+        }
+        if (context < 1) {
+            cerr << "Context size must be at least 1. Exiting." << endl;
+            return 1;
+        }
+        if (findGgufQuant(shortQuant) != nullptr) {
+            quantFormat = "gguf";
+            quantSize = argv[2];
+            bpw = findGgufQuant(quantSize)->bpw;
+        }
+        else {
+            quantFormat = shortQuant;
+            bpw = quant_formats.at(quantFormat).bits;
+        }
+    }
     // gui mode onramp
-    if (argc != 8 && argc != 7) {
+    else if (argc != 8 && argc != 7) {
         cout << "If you were looking for the CLI mode, please use the format below." << endl;
-        cout << "Usage: " << argv[0] << " <path_to_config_json>" << " <parameters (float, billions)>" << " <quant_format (gguf or exl2)>" << " <context_size (int)>"
-            << " <kv_cache_bit_size (16/8/4)>" << " <batch_size (if gguf, int)>" << " [<bpw (if exl2, float)>" << " <quant_size (if gguf, string)>]" <<
+        cout << "Usage: " << argv[0] << " <path_to_config_json>" << " <parameters (float, billions)>" << " <quant_format (gguf, exl2, ...)>" << " <context_size (int)>"
+            << " <kv_cache_bit_size (16/8/4)>" << " <batch_size (if gguf, int)>" << " [<bpw (if not gguf, float)>" << " <quant_size (if gguf, string)>]" <<
             "\nwhere you only include one from the square bracket pair depending on your desired quant format." << '\n' << endl;
         
         cout << "Enter your model config path (local):\n";
@@ -168,10 +4810,19 @@ int main(int argc, char* argv[]) {
         cin >> p;
         p *= 1000000000;
 
-		cout << "Enter quant format (gguf or exl2):\n";
+        cout << "Enter quant format. Valid options:\n";
+        for (auto& kv : quant_formats) {
+            cout << " - " << kv.first << " (" << kv.second.engine << ")\n";
+        }
         cin >> quantFormat;
         std::transform(quantFormat.begin(), quantFormat.end(), quantFormat.begin(), ::tolower);
 
+        if (quant_formats.find(quantFormat) == quant_formats.end()) {
+            cout << "Unsupported quant format (" << quantFormat << "). Exiting." << endl;
+            return 1;
+        }
+        const QuantFormat& qf = quant_formats.at(quantFormat);
+
         cout << "Enter context size (default 8192):\n";
         // handle newline behaviour
         string input;
@@ -187,111 +4838,87 @@ int main(int argc, char* argv[]) {
             }
         }
 
-        if (quantFormat == "gguf") {
+        if (qf.gguf_table) {
             cout << "Enter quantization size (default Q4_K_S). Valid options:\n";
-            for (auto& kv : gguf_quants) {
-                cout << " - " << kv.first << "\n";
+            for (auto& q : gguf_quants) {
+                cout << " - " << q.name << "\n";
             }
             cout << "Quantization size: ";
-            string quantSize;
             getline(cin, quantSize);
             if (quantSize.empty()) quantSize = "Q4_K_S";
             else quantSize.erase(remove_if(quantSize.begin(), quantSize.end(), ::isspace), quantSize.end()); // trim spaces
 
-            // map case sensitive
-            if (gguf_quants.find(quantSize) == gguf_quants.end()) {
+            if (findGgufQuant(quantSize) == nullptr) {
                 cout << "Invalid quantization size entered, defaulting to Q4_K_S" << endl;
                 quantSize = "Q4_K_S";
             }
 
-            cout << "Enter KV Cache bit size (16, 8, or 4) (default 16): ";
-            string kvStr;
-            getline(cin, kvStr);
-            if (!kvStr.empty()) {
-                try {
-                    int v = stoi(kvStr);
-                    if (v == 16 || v == 8 || v == 4) {
-                        cache_bit = v;
-                    }
-                    else {
-                        cout << "Invalid KV cache bit size, defaulting to 16." << endl;
-                        cache_bit = 16;
-                    }
-                }
-                catch (...) {
-                    cout << "Invalid KV cache bit size, defaulting to 16." << endl;
-                    cache_bit = 16;
-                }
-            }
-            else {
-                cache_bit = 16;
-            }
-
-            cout << "Enter batch size (default 512): ";
-            string batchStr;
-            getline(cin, batchStr);
-            if (!batchStr.empty()) {
-                try {
-                    int tmpbsz = stoi(batchStr);
-                    if (tmpbsz > 0) bsz = tmpbsz;
-                }
-                catch (...) {
-                    cout << "Invalid input for batch size, using default 512." << endl;
-                }
-            }
-
-            bpw = gguf_quants.at(quantSize);
-
+            bpw = findGgufQuant(quantSize)->bpw;
         }
-        else if (quantFormat == "exl2") {
-            cout << "Enter BPW (bits per weight) (default 4.5): ";
+        else if (!qf.native_dtype) {
+            cout << "Enter BPW (bits per weight) (default " << qf.bits << "): ";
             string bpwStr;
             getline(cin, bpwStr);
             if (!bpwStr.empty()) {
                 try {
                     bpw = stod(bpwStr);
                     if (bpw <= 0) {
-                        cout << "Invalid BPW; must be positive. Using default 4.5." << endl;
-                        bpw = 4.5;
+                        cout << "Invalid BPW; must be positive. Using default " << qf.bits << "." << endl;
+                        bpw = qf.bits;
                     }
                 }
                 catch (...) {
-                    cout << "Invalid BPW input; using default 4.5." << endl;
-                    bpw = 4.5;
+                    cout << "Invalid BPW input; using default " << qf.bits << "." << endl;
+                    bpw = qf.bits;
                 }
             }
             else {
-                bpw = 4.5;
+                bpw = qf.bits;
             }
+        }
 
-            cout << "Enter KV Cache bit size (16, 8, or 4) (default 16): ";
-            string kvStr;
-            getline(cin, kvStr);
-            if (!kvStr.empty()) {
-                try {
-                    int v = stoi(kvStr);
-                    if (v == 16 || v == 8 || v == 4) {
-                        cache_bit = v;
-                    }
-                    else {
-                        cout << "Invalid KV cache bit size, defaulting to 16." << endl;
-                        cache_bit = 16;
-                    }
+        cout << "Enter KV Cache bit size (16, 8, or 4) (default 16): ";
+        string kvStr;
+        getline(cin, kvStr);
+        if (!kvStr.empty()) {
+            try {
+                int v = stoi(kvStr);
+                if (v == 16 || v == 8 || v == 4) {
+                    cache_bit = v;
                 }
-                catch (...) {
+                else {
                     cout << "Invalid KV cache bit size, defaulting to 16." << endl;
                     cache_bit = 16;
                 }
             }
-            else {
+            catch (...) {
+                cout << "Invalid KV cache bit size, defaulting to 16." << endl;
                 cache_bit = 16;
             }
-
         }
         else {
-            cout << "Unsupported quant format (" << quantFormat << "). Exiting." << endl;
-            return 1;
+            cache_bit = 16;
+        }
+
+        if (qf.gguf_table) {
+            cout << "Enter batch size (default 512): ";
+            string batchStr;
+            getline(cin, batchStr);
+            if (!batchStr.empty()) {
+                try {
+                    int tmpbsz = stoi(batchStr);
+                    if (tmpbsz > 0) bsz = tmpbsz;
+                }
+                catch (...) {
+                    cout << "Invalid input for batch size, using default 512." << endl;
+                }
+            }
         }
+
+        cout << "Keep logits for every prompt token, e.g. perplexity/embedding runs? (y/N): ";
+        string logitsStr;
+        getline(cin, logitsStr);
+        all_logits = !logitsStr.empty() && (logitsStr[0] == 'y' || logitsStr[0] == 'Y');
     }
     // cli mode
     else {
@@ -300,67 +4927,138 @@ int main(int argc, char* argv[]) {
         p = atof(argv[2]) * 1e9L;
 
         quantFormat = argv[3];
+        std::transform(quantFormat.begin(), quantFormat.end(), quantFormat.begin(), ::tolower);
 
         context = atoi(argv[4]);
 
-        if (quantFormat == "gguf") {
-			cache_bit = atoi(argv[5]);
+        if (quant_formats.find(quantFormat) == quant_formats.end()) {
+            cerr << "Unsupported quant format (" << quantFormat << "). Exiting." << endl;
+            return 1;
+        }
+        const QuantFormat& qf = quant_formats.at(quantFormat);
+
+        if (qf.gguf_table) {
+            if (argc != 8) {
+                cerr << "gguf expects <kv_cache_bit_size> <batch_size> <quant_size>. Exiting." << endl;
+                return 1;
+            }
+            cache_bit = atoi(argv[5]);
             bsz = atoi(argv[6]);
             quantSize = argv[7];
-            bpw = gguf_quants.at(quantSize);
-        } else if (quantFormat == "exl2") {
+            const GgufQuant* gq = findGgufQuant(quantSize);
+            if (gq == nullptr) {
+                cerr << "Unknown gguf quant size (" << quantSize << "). Exiting." << endl;
+                return 1;
+            }
+            bpw = gq->bpw;
+        }
+        else {
             cache_bit = atoi(argv[5]);
             bpw = atof(argv[6]);
+            // 0 means use the format default
+            if (bpw <= 0) bpw = qf.bits;
         }
-        else {
-            cerr << "Unsupported quant format (" << quantFormat << "). Exiting." << endl;
-            return 1;
-		}
     }
 
     // read config file (this happens no matter if cli or not)
-    ifstream file(configPath);
-    if (!file.is_open()) {
-        cerr << "Failed to open config file: " << configPath << endl;
-        return 1;
-    }
-
-    json configJson;
-    try {
-        file >> configJson;
-    }
-    catch (exception& e) {
-        cerr << "Failed to parse JSON: " << e.what() << endl;
-        return 1;
-    }
-
     ModelConfig mc;
     try {
-        mc = parseConfig(configJson, p);
+        mc = loadModelConfig(configPath, p);
     }
     catch (exception& e) {
-        cerr << "Error parsing model config: " << e.what() << endl;
+        cerr << e.what() << endl;
         return 1;
     }
 
     // showtime
     try {
-        double model_size = modelSize(mc, bpw);
-        double context_size = ctxSize(context, mc, bsz, cache_bit);
-        double total_size = model_size + context_size;
+        const QuantFormat& qf = quant_formats.at(quantFormat);
+        const GgufQuant* gq = qf.gguf_table ? findGgufQuant(quantSize) : nullptr;
+        if (!coefficients.empty()) {
+            CostCoefficients c = costCoefficients(mc, quantFormat, gq ? quantSize : to_string(bpw), cache_bit, all_logits,
+                n_images, image_size);
+            ostringstream label;
+            label << configPath << " " << quantFormat << " ";
+            if (gq) label << gq->name;
+            else label << bpw << "bpw";
+            label << " kv" << cache_bit;
+            printCoefficients(c, coefficients, label.str());
+            return 0;
+        }
+        Estimate e = estimateMemory(mc, quantFormat, gq ? quantSize : to_string(bpw), context, bsz, cache_bit, all_logits,
+            n_images, image_size);
+        double model_size = e.model_size;
+        double context_size = e.context_size;
+        double overhead = e.overhead;
+        double mm_size = e.multimodal;
+        int image_tokens = e.image_tokens;
+        if (image_tokens * n_images > context) {
+            int resolution = image_size > 0 ? image_size : (mc.vision.image_size > 0 ? mc.vision.image_size : 448);
+            cerr << "Warning: " << n_images << " image(s) at " << resolution << "px take " << image_tokens * n_images
+                << " tokens, more than the context size" << endl;
+        }
+
+        double total_size = e.total();
+
+        vector<RankEstimate> ranks;
+        if (tp * pp > 1) {
+            if (tensorList(mc).empty()) {
+                cerr << "Warning: the config doesn't describe every tensor, skipping the per rank split" << endl;
+            }
+            else {
+                // what computeBuffer priced for the estimate, without warning about -b a second time
+                double compute_buf = ubatchComputeBuffer(context, mc, 512, false);
+                for (int stage = 0; stage < pp; stage++) {
+                    ranks.push_back(rankEstimate(mc, qf, bpw, gq, context, bsz, compute_buf, cache_bit, all_logits, tp, pp, stage));
+                }
+            }
+        }
 
         if (argc != 7) {
             cout << fixed << setprecision(3);
             cout << "\nResults (in GB):" << endl;
             cout << "  Model Size:   " << model_size / (1024 * 1024 * 1024) << " GB" << endl;
             cout << "  Context Size: " << context_size / (1024 * 1024 * 1024) << " GB" << endl;
+            if (overhead > 0) {
+                cout << "  Overhead:     " << overhead / (1024 * 1024 * 1024) << " GB" << endl;
+            }
+            if (mm_size > 0) {
+                cout << "  Multimodal:   " << mm_size / (1024 * 1024 * 1024) << " GB";
+                if (image_tokens > 0) cout << " (" << image_tokens << " tokens per image)";
+                cout << endl;
+            }
             cout << "  Total Size:   " << total_size / (1024 * 1024 * 1024) << " GB" << endl;
+
+            if (!ranks.empty()) {
+                cout << "\nPer rank (tp " << tp << " x pp " << pp << "):" << endl;
+                for (auto& r : ranks) {
+                    cout << "  Stage " << r.stage << ": weights " << r.weights / GIB << " GB, kv " << r.kv / GIB
+                        << " GB, buffers " << r.activations / GIB << " GB, total " << (r.weights + r.kv + r.activations) / GIB << " GB" << endl;
+                }
+            }
+
+            if (show_tensors && gq) {
+                printGgufTensors(mc, *gq);
+            }
         }
         else {
             cout << fixed << setprecision(8);
             std::cout << "{\n";
             std::cout << "  \"model_size\": " << model_size / (1024 * 1024 * 1024) << ",\n";
             std::cout << "  \"context_size\": " << context_size / (1024 * 1024 * 1024) << ",\n";
+            std::cout << "  \"runtime_overhead\": " << overhead / (1024 * 1024 * 1024) << ",\n";
+            std::cout << "  \"multimodal_size\": " << mm_size / (1024 * 1024 * 1024) << ",\n";
+            std::cout << "  \"image_tokens\": " << image_tokens << ",\n";
+            if (!ranks.empty()) {
+                std::cout << "  \"per_rank\": [\n";
+                for (size_t i = 0; i < ranks.size(); i++) {
+                    auto& r = ranks[i];
+                    std::cout << "    {\"stage\": " << r.stage << ", \"weights\": " << r.weights / GIB << ", \"kv_cache\": " << r.kv / GIB
+                        << ", \"buffers\": " << r.activations / GIB << ", \"total\": " << (r.weights + r.kv + r.activations) / GIB << "}"
+                        << (i + 1 < ranks.size() ? ",\n" : "\n");
+                }
+                std::cout << "  ],\n";
+            }
             std::cout << "  \"total_size\": " << total_size / (1024 * 1024 * 1024) << "\n";
             std::cout << "}" << std::endl;
 
@@ -0,0 +1,133 @@
+#!/usr/bin/env python3
+# regression checks against numbers that can be verified outside the tool:
+#   python3 tests/regression.py <path to llmcalculator binary>
+# exits non zero and says which check failed when one does
+import importlib.util
+import json
+import os
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+LLAMA = os.path.join(HERE, "llama-3.1-8b", "config.json")
+LLAMA_PARAMS = "8.030261248"
+# model.safetensors.index.json of meta-llama/Llama-3.1-8B
+LLAMA_TOTAL_SIZE = 16060522496
+GIB = 1024 ** 3
+
+failures = []
+
+
+def run(binary, *args):
+    # stdin closed, a bad command line would otherwise drop into interactive mode and wait
+    result = subprocess.run([binary, *args], stdin=subprocess.DEVNULL, capture_output=True, text=True, timeout=120)
+    if result.returncode != 0:
+        raise RuntimeError(f"{' '.join(args)} exited {result.returncode}: {result.stderr.strip()}")
+    return result.stdout
+
+
+def check(name, ok, detail=""):
+    print(f"{'ok  ' if ok else 'FAIL'} {name}" + (f": {detail}" if detail and not ok else ""))
+    if not ok:
+        failures.append(name)
+
+
+def gib(out, label):
+    m = re.search(label + r":\s+([0-9.]+) GB", out)
+    return float(m.group(1)) if m else None
+
+
+def tensor_rows(out):
+    # "  attn_v        Q6_K        16 x  52.500 MB" -> {("attn_v", "Q6_K"): 16}
+    rows = {}
+    for m in re.finditer(r"^\s+(\w+)\s+(\w+)\s+(\d+) x\s+[0-9.]+ MB$", out, re.M):
+        rows[(m.group(1), m.group(2))] = int(m.group(3))
+    return rows
+
+
+# llama.cpp's Q4_K_M of Llama-3.1-8B is 4.58 GiB: Q4_K everywhere except half of attn_v and ffn_down
+# (use_more_bits) and the output tensor at Q6_K
+def check_q4_k_m(binary):
+    out = run(binary, LLAMA, LLAMA_PARAMS, "gguf", "8192", "16", "512", "Q4_K_M", "--tensors")
+    check("Q4_K_M model size is 4.575 GiB", gib(out, "Model Size") == 4.575, f"got {gib(out, 'Model Size')}")
+    rows = tensor_rows(out)
+    expected = {
+        ("token_embd", "Q4_K"): 1, ("output", "Q6_K"): 1,
+        ("attn_q", "Q4_K"): 32, ("attn_k", "Q4_K"): 32, ("attn_output", "Q4_K"): 32,
+        ("attn_v", "Q4_K"): 16, ("attn_v", "Q6_K"): 16,
+        ("ffn_gate", "Q4_K"): 32, ("ffn_up", "Q4_K"): 32,
+        ("ffn_down", "Q4_K"): 16, ("ffn_down", "Q6_K"): 16,
+    }
+    for key, count in expected.items():
+        check(f"Q4_K_M {key[0]} {key[1]} x {count}", rows.get(key) == count, f"got {rows.get(key)}")
+    quantized = {k: v for k, v in rows.items() if k[1] != "F32"}
+    check("Q4_K_M has no other quantized tensors", quantized == expected, f"got {quantized}")
+
+
+# the --coefficients module has to give back the estimate's total at any context and batch
+def check_coefficients(binary):
+    source = run(binary, LLAMA, LLAMA_PARAMS, "gguf", "8192", "16", "512", "Q4_K_M", "--coefficients", "python")
+    spec = importlib.util.spec_from_loader("coefficients", loader=None)
+    module = importlib.util.module_from_spec(spec)
+    exec(source, module.__dict__)
+    for ctx in (512, 8192, 32768):
+        for batch in (512, 2048):
+            out = run(binary, LLAMA, LLAMA_PARAMS, "gguf", str(ctx), "16", str(batch), "Q4_K_M")
+            total = gib(out, "Total Size")
+            predicted = module.bytes_needed(ctx, batch) / GIB
+            # the estimate prints three decimals
+            check(f"coefficients reproduce ctx {ctx} batch {batch}", total is not None and abs(predicted - total) <= 0.0005,
+                  f"estimate {total}, coefficients {predicted:.6f}")
+
+
+# a catalog holds what scan found, and a cataloged name estimates the same as its config
+def check_catalog(binary):
+    library = tempfile.mkdtemp()
+    try:
+        for name in ("meta-llama/Llama-3.1-8B", "meta-llama/Llama-3.1-8B-Instruct"):
+            target = os.path.join(library, name)
+            os.makedirs(target)
+            shutil.copy(LLAMA, os.path.join(target, "config.json"))
+            with open(os.path.join(target, "model.safetensors.index.json"), "w") as f:
+                json.dump({"metadata": {"total_size": LLAMA_TOTAL_SIZE}}, f)
+        catalog = os.path.join(library, "models.cat")
+
+        built = json.loads(run(binary, "catalog", "build", library, catalog))
+        listed = json.loads(run(binary, "catalog", "list", catalog))
+        check("catalog build counts every model", built["models"] == 2 and built["skipped"] == 0, f"got {built}")
+        check("catalog list matches build", len(listed) == built["models"], f"listed {len(listed)}")
+        names = sorted(m["name"] for m in listed)
+        check("catalog names", names == ["meta-llama/Llama-3.1-8B", "meta-llama/Llama-3.1-8B-Instruct"], f"got {names}")
+        for m in listed:
+            check(f"catalog {m['name']} parameters", m["parameters"] == LLAMA_TOTAL_SIZE / 2, f"got {m['parameters']}")
+            check(f"catalog {m['name']} weights", abs(m["weights"] - LLAMA_TOTAL_SIZE / GIB) < 1e-9, f"got {m['weights']}")
+
+        direct = run(binary, LLAMA, LLAMA_PARAMS, "gguf", "8192", "16", "512", "Q4_K_M")
+        cataloged = run(binary, "--catalog", catalog, "meta-llama/Llama-3.1-8B", "0", "gguf", "8192", "16", "512", "Q4_K_M")
+        check("cataloged estimate matches the config", cataloged == direct, f"\n{cataloged}\nvs\n{direct}")
+    finally:
+        shutil.rmtree(library)
+
+
+def main():
+    if len(sys.argv) != 2:
+        print("Usage: regression.py <llmcalculator binary>")
+        return 2
+    binary = sys.argv[1]
+    for test in (check_q4_k_m, check_coefficients, check_catalog):
+        try:
+            test(binary)
+        except Exception as e:
+            check(test.__name__, False, str(e))
+    if failures:
+        print(f"{len(failures)} check(s) failed")
+        return 1
+    print("all checks passed")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())